@@ -0,0 +1,239 @@
+#include "color_convert.h"
+#include "simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define CBRT_TABLE_SIZE 1024
+#define CBRT_TABLE_MAX 1.0625f  // X/Xn, Y/Yn and Z/Zn of 8-bit sRGB stay below 1.0002
+
+static float unit_scale[256];     // i / 255.0f
+static float srgb_linear[256];    // the linearized value rgb_to_lab computes for i
+static float cbrt_table[CBRT_TABLE_SIZE + 1];
+static volatile int tables_ready = 0;
+
+void color_convert_init(void) {
+	if (tables_ready) return;
+
+#pragma omp critical(color_convert_init)
+	{
+		if (!tables_ready) {
+			for (int i = 0; i < 256; i++) {
+				float v = i / 255.0f;
+				unit_scale[i] = v;
+				srgb_linear[i] = (v > 0.04045f) ? powf((v + 0.055f) / 1.055f, 2.4f) : (v / 12.92f);
+			}
+			for (int i = 0; i <= CBRT_TABLE_SIZE; i++) {
+				cbrt_table[i] = cbrtf(i * (CBRT_TABLE_MAX / CBRT_TABLE_SIZE));
+			}
+			tables_ready = 1;
+		}
+	}
+}
+
+// The Lab companding function f(t): interpolated cube root refined by one Newton step.
+static inline float lab_f(float t) {
+	if (t <= 0.008856f) return 7.787f * t + 16.0f / 116.0f;
+
+	float pos = t * (CBRT_TABLE_SIZE / CBRT_TABLE_MAX);
+	int i = (int)pos;
+	if (i > CBRT_TABLE_SIZE - 1) i = CBRT_TABLE_SIZE - 1;
+	float frac = pos - (float)i;
+	float c = cbrt_table[i] + (cbrt_table[i + 1] - cbrt_table[i]) * frac;
+
+	return (2.0f * c + t / (c * c)) / 3.0f;
+}
+
+static inline void lab_encode(float fx, float fy, float fz, Pixel* out) {
+	float l = (116.0f * fy) - 16.0f;
+	float a = 500.0f * (fx - fy);
+	float b = 200.0f * (fy - fz);
+
+	out->r = (int)(l * 2.55f);
+	out->g = (int)(a + 128.0f);
+	out->b = (int)(b + 128.0f);
+}
+
+#ifdef SIMD_SSE2
+static inline __m128 lab_f_sse2(__m128 t) {
+	int idx[4];
+	float c0[4], c1[4];
+
+	__m128 pos = _mm_mul_ps(t, _mm_set1_ps(CBRT_TABLE_SIZE / CBRT_TABLE_MAX));
+	_mm_storeu_si128((__m128i*)idx, _mm_cvttps_epi32(pos));
+	for (int k = 0; k < 4; k++) {
+		if (idx[k] > CBRT_TABLE_SIZE - 1) idx[k] = CBRT_TABLE_SIZE - 1;
+		if (idx[k] < 0) idx[k] = 0;
+		c0[k] = cbrt_table[idx[k]];
+		c1[k] = cbrt_table[idx[k] + 1];
+	}
+
+	__m128 lo = _mm_loadu_ps(c0);
+	__m128 frac = _mm_sub_ps(pos, _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)idx)));
+	__m128 c = _mm_add_ps(lo, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(c1), lo), frac));
+	__m128 root = _mm_div_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.0f), c), _mm_div_ps(t, _mm_mul_ps(c, c))), _mm_set1_ps(3.0f));
+
+	__m128 linear = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(7.787f), t), _mm_set1_ps(16.0f / 116.0f));
+	__m128 small = _mm_cmple_ps(t, _mm_set1_ps(0.008856f));
+	return _mm_or_ps(_mm_and_ps(small, linear), _mm_andnot_ps(small, root));
+}
+#endif
+
+void rgb_row_to_lab(const Pixel* src, Pixel* dst, int count) {
+	color_convert_init();
+	int i = 0;
+
+#ifdef SIMD_SSE2
+	for (; i + 4 <= count; i += 4) {
+		float lr[4], lg[4], lb[4];
+		for (int k = 0; k < 4; k++) {
+			lr[k] = srgb_linear[src[i + k].r];
+			lg[k] = srgb_linear[src[i + k].g];
+			lb[k] = srgb_linear[src[i + k].b];
+		}
+		__m128 r = _mm_loadu_ps(lr);
+		__m128 g = _mm_loadu_ps(lg);
+		__m128 b = _mm_loadu_ps(lb);
+
+		__m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.4124f)), _mm_mul_ps(g, _mm_set1_ps(0.3576f))), _mm_mul_ps(b, _mm_set1_ps(0.1805f)));
+		__m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126f)), _mm_mul_ps(g, _mm_set1_ps(0.7152f))), _mm_mul_ps(b, _mm_set1_ps(0.0722f)));
+		__m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.0193f)), _mm_mul_ps(g, _mm_set1_ps(0.1192f))), _mm_mul_ps(b, _mm_set1_ps(0.9505f)));
+
+		x = _mm_div_ps(x, _mm_set1_ps(0.95047f));
+		z = _mm_div_ps(z, _mm_set1_ps(1.08883f));
+
+		__m128 fx = lab_f_sse2(x);
+		__m128 fy = lab_f_sse2(y);
+		__m128 fz = lab_f_sse2(z);
+
+		__m128 l = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(116.0f), fy), _mm_set1_ps(16.0f));
+		__m128 a = _mm_mul_ps(_mm_set1_ps(500.0f), _mm_sub_ps(fx, fy));
+		__m128 bb = _mm_mul_ps(_mm_set1_ps(200.0f), _mm_sub_ps(fy, fz));
+
+		int out_l[4], out_a[4], out_b[4];
+		_mm_storeu_si128((__m128i*)out_l, _mm_cvttps_epi32(_mm_mul_ps(l, _mm_set1_ps(2.55f))));
+		_mm_storeu_si128((__m128i*)out_a, _mm_cvttps_epi32(_mm_add_ps(a, _mm_set1_ps(128.0f))));
+		_mm_storeu_si128((__m128i*)out_b, _mm_cvttps_epi32(_mm_add_ps(bb, _mm_set1_ps(128.0f))));
+		for (int k = 0; k < 4; k++) {
+			dst[i + k].r = out_l[k];
+			dst[i + k].g = out_a[k];
+			dst[i + k].b = out_b[k];
+		}
+	}
+#endif
+
+	for (; i < count; i++) {
+		float r = srgb_linear[src[i].r];
+		float g = srgb_linear[src[i].g];
+		float b = srgb_linear[src[i].b];
+
+		float x = (r * 0.4124f + g * 0.3576f + b * 0.1805f) / 0.95047f;
+		float y = r * 0.2126f + g * 0.7152f + b * 0.0722f;
+		float z = (r * 0.0193f + g * 0.1192f + b * 0.9505f) / 1.08883f;
+
+		lab_encode(lab_f(x), lab_f(y), lab_f(z), &dst[i]);
+	}
+}
+
+void rgb_row_to_hsv(const Pixel* src, Pixel* dst, int count) {
+	color_convert_init();
+	int i = 0;
+
+#ifdef SIMD_SSE2
+	for (; i + 4 <= count; i += 4) {
+		float fr[4], fg[4], fb[4];
+		for (int k = 0; k < 4; k++) {
+			fr[k] = unit_scale[src[i + k].r];
+			fg[k] = unit_scale[src[i + k].g];
+			fb[k] = unit_scale[src[i + k].b];
+		}
+		__m128 r = _mm_loadu_ps(fr);
+		__m128 g = _mm_loadu_ps(fg);
+		__m128 b = _mm_loadu_ps(fb);
+		const __m128 zero = _mm_setzero_ps();
+
+		__m128 cmax = _mm_max_ps(r, _mm_max_ps(g, b));
+		__m128 cmin = _mm_min_ps(r, _mm_min_ps(g, b));
+		__m128 delta = _mm_sub_ps(cmax, cmin);
+
+		// All three hue candidates are computed; delta == 0 lanes are masked out below.
+		__m128 sixty = _mm_set1_ps(60.0f);
+		__m128 h_r = _mm_mul_ps(sixty, _mm_div_ps(_mm_sub_ps(g, b), delta));
+		__m128 h_g = _mm_mul_ps(sixty, _mm_add_ps(_mm_div_ps(_mm_sub_ps(b, r), delta), _mm_set1_ps(2.0f)));
+		__m128 h_b = _mm_mul_ps(sixty, _mm_add_ps(_mm_div_ps(_mm_sub_ps(r, g), delta), _mm_set1_ps(4.0f)));
+
+		__m128 is_r = _mm_cmpeq_ps(cmax, r);
+		__m128 is_g = _mm_andnot_ps(is_r, _mm_cmpeq_ps(cmax, g));
+		__m128 is_b = _mm_andnot_ps(_mm_or_ps(is_r, is_g), _mm_cmpeq_ps(cmax, cmax));
+		__m128 h = _mm_or_ps(_mm_or_ps(_mm_and_ps(is_r, h_r), _mm_and_ps(is_g, h_g)), _mm_and_ps(is_b, h_b));
+		h = _mm_andnot_ps(_mm_cmpeq_ps(delta, zero), h);
+		h = _mm_add_ps(h, _mm_and_ps(_mm_cmplt_ps(h, zero), _mm_set1_ps(360.0f)));
+
+		__m128 s = _mm_andnot_ps(_mm_cmpeq_ps(cmax, zero), _mm_div_ps(delta, cmax));
+
+		int out_h[4], out_s[4], out_v[4];
+		_mm_storeu_si128((__m128i*)out_h, _mm_cvttps_epi32(_mm_mul_ps(_mm_div_ps(h, _mm_set1_ps(360.0f)), _mm_set1_ps(255.0f))));
+		_mm_storeu_si128((__m128i*)out_s, _mm_cvttps_epi32(_mm_mul_ps(s, _mm_set1_ps(255.0f))));
+		_mm_storeu_si128((__m128i*)out_v, _mm_cvttps_epi32(_mm_mul_ps(cmax, _mm_set1_ps(255.0f))));
+		for (int k = 0; k < 4; k++) {
+			dst[i + k].r = out_h[k];
+			dst[i + k].g = out_s[k];
+			dst[i + k].b = out_v[k];
+		}
+	}
+#endif
+
+	for (; i < count; i++) {
+		float r = unit_scale[src[i].r];
+		float g = unit_scale[src[i].g];
+		float b = unit_scale[src[i].b];
+
+		float cmax = fmaxf(r, fmaxf(g, b));
+		float cmin = fminf(r, fminf(g, b));
+		float delta = cmax - cmin;
+
+		// |g - b| <= delta when r is the maximum, so the fmodf of rgb_to_hsv never changes the value.
+		float h;
+		if (delta == 0) h = 0;
+		else if (cmax == r) h = 60 * ((g - b) / delta);
+		else if (cmax == g) h = 60 * (((b - r) / delta) + 2);
+		else h = 60 * (((r - g) / delta) + 4);
+		if (h < 0) h += 360;
+
+		float s = (cmax == 0) ? 0 : (delta / cmax);
+
+		dst[i].r = (int)(h / 360.0f * 255.0f);
+		dst[i].g = (int)(s * 255.0f);
+		dst[i].b = (int)(cmax * 255.0f);
+	}
+}
+
+static const ColorRowConverter row_converters[COLOR_CONVERT_COUNT] = {
+	rgb_row_to_lab,
+	rgb_row_to_hsv,
+};
+
+void color_convert_row(ColorConversion conversion, const Pixel* src, Pixel* dst, int count) {
+	row_converters[conversion](src, dst, count);
+}
+
+void color_convert_image(const Image* src, Image* dst, ColorConversion conversion) {
+	dst->width = src->width;
+	dst->height = src->height;
+	dst->channels = src->channels;
+	dst->pixels = (Pixel*)malloc(sizeof(Pixel) * src->width * src->height);
+	if (dst->pixels == NULL) {
+		fprintf(stderr, "malloc failed in color_convert_image\n");
+		return;
+	}
+
+	color_convert_init();
+	ColorRowConverter convert = row_converters[conversion];
+	int width = src->width;
+
+#pragma omp parallel for schedule(static)
+	for (int y = 0; y < src->height; y++) {
+		convert(&src->pixels[(size_t)y * width], &dst->pixels[(size_t)y * width], width);
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef __COLOR_CONVERT_H__
+#define __COLOR_CONVERT_H__
+
+#include "image.h"
+
+/*
+Table driven colour space conversion of 8-bit RGB images.
+The byte encodings are the ones convert_image_to_lab and convert_image_to_hsv produce,
+within +-1 per channel (color_convert_test checks every RGB value).
+
+A new colour space is added as one more ColorConversion value plus a row converter
+registered in color_convert.c.
+*/
+typedef enum {
+	COLOR_CONVERT_LAB,  // L*(0-100) -> 0-255, a* and b* offset by 128
+	COLOR_CONVERT_HSV,  // H(0-360), S(0-1), V(0-1) -> 0-255
+	COLOR_CONVERT_COUNT
+} ColorConversion;
+
+typedef void (*ColorRowConverter)(const Pixel* src, Pixel* dst, int count);
+
+// Builds the lookup tables. The image converters call it themselves; call it once
+// before converting rows from several threads.
+void color_convert_init(void);
+
+void rgb_row_to_lab(const Pixel* src, Pixel* dst, int count);
+void rgb_row_to_hsv(const Pixel* src, Pixel* dst, int count);
+
+void color_convert_row(ColorConversion conversion, const Pixel* src, Pixel* dst, int count);
+
+// Allocates dst and converts src into it, one row per OpenMP iteration.
+void color_convert_image(const Image* src, Image* dst, ColorConversion conversion);
+
+#endif // !__COLOR_CONVERT_H__
@@ -8,46 +8,77 @@ void ds_init(DisjointSet* ds, int n) {
     assert(ds != NULL);
 
     ds->count = n;
-    ds->parent = malloc(sizeof(int) * n);
-    ds->size = malloc(sizeof(int) * n);
+    ds->nodes = malloc(sizeof(DSNode) * (n > 0 ? n : 1));
 
-    if (ds->parent == NULL || ds->size == NULL) {
+    if (ds->nodes == NULL) {
         fprintf(stderr, "FATAL ERROR: Memory allocation failed in ds_init for %d elements.\n", n);
-        free(ds->parent);
-        free(ds->size);
         exit(EXIT_FAILURE); // Using exit because this is a fatal error
     }
 
     for (int i = 0; i < n; i++) {
-        ds->parent[i] = i;
-        ds->size[i] = 1;
+        ds->nodes[i].parent = i;
+        ds->nodes[i].size = 1;
+        ds->nodes[i].internal = 0.0f;
+        ds->nodes[i].region = -1;
     }
 }
 
 
 int ds_find(DisjointSet* ds, int x) {
-    if (ds->parent[x] != x) {
-        ds->parent[x] = ds_find(ds, ds->parent[x]);  // path compression
+    // Iterative, with path halving: every visited node is pointed at its grandparent.
+    DSNode* nodes = ds->nodes;
+    while (nodes[x].parent != x) {
+        int grandparent = nodes[nodes[x].parent].parent;
+        nodes[x].parent = grandparent;
+        x = grandparent;
     }
-    return ds->parent[x];
+    return x;
 }
 
-void ds_union(DisjointSet* ds, int x, int y) {
+int ds_union(DisjointSet* ds, int x, int y) {
+    // Returns the root of the merged set.
     int rx = ds_find(ds, x);
     int ry = ds_find(ds, y);
-    if (rx == ry) return;  // already in same set
+    if (rx == ry) return rx;  // already in same set
 
-    if (ds->size[rx] < ds->size[ry]) {
-        ds->parent[rx] = ry;
-        ds->size[ry] += ds->size[rx];
+    if (ds->nodes[rx].size < ds->nodes[ry].size) {
+        ds->nodes[rx].parent = ry;
+        ds->nodes[ry].size += ds->nodes[rx].size;
+        return ry;
     }
     else {
-        ds->parent[ry] = rx;
-        ds->size[rx] += ds->size[ry];
+        ds->nodes[ry].parent = rx;
+        ds->nodes[rx].size += ds->nodes[ry].size;
+        return rx;
     }
 }
 
+int ds_flatten(DisjointSet* ds, int* labels) {
+    /*
+    Writes a dense label 0..R-1 for every element into labels and returns R.
+    Roots are numbered in increasing index order and keep their label in nodes[root].region.
+    The labelling pass only reads the forest, so it runs in parallel.
+    */
+
+    DSNode* nodes = ds->nodes;
+    int n = ds->count;
+
+    int region_count = 0;
+    for (int i = 0; i < n; i++) {
+        nodes[i].region = (nodes[i].parent == i) ? region_count++ : -1;
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        int root = i;
+        while (nodes[root].parent != root) root = nodes[root].parent;
+        labels[i] = nodes[root].region;
+    }
+
+    return region_count;
+}
+
 void ds_free(DisjointSet* ds) {
-    free(ds->parent);
-    free(ds->size);
-}
\ No newline at end of file
+    free(ds->nodes);
+    ds->nodes = NULL;
+}
@@ -1,9 +1,19 @@
 #ifndef __DISJOINT_SET_H__
 #define __DISJOINT_SET_H__
 
+/*
+One record per element, 16 bytes, so four share a cache line.
+parent is valid for every element; the other fields are only meaningful at roots.
+*/
 typedef struct {
-	int* parent;
-	int* size;
+	int parent;
+	int size;		// number of elements in the set
+	float internal;	// largest edge weight merged into the set (GBS internal difference)
+	int region;		// dense region index, -1 until assigned
+} DSNode;
+
+typedef struct {
+	DSNode* nodes;
 	int count;
 } DisjointSet;
 
@@ -11,7 +21,9 @@ void ds_init(DisjointSet* ds, int n);
 
 int ds_find(DisjointSet* ds, int x);
 
-void ds_union(DisjointSet* ds, int x, int y);
+int ds_union(DisjointSet* ds, int x, int y);
+
+int ds_flatten(DisjointSet* ds, int* labels);
 
 void ds_free(DisjointSet* ds);
 
@@ -0,0 +1,176 @@
+#include "image.h"
+#include "gaussian_blur.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+
+void gaussian_blur_init(GaussianBlur* gb, float sigma, int kernel_size) {
+	assert(gb != NULL);
+	assert(kernel_size % 2 == 1);
+
+	gb->radius = kernel_size / 2;
+	gb->taps = malloc(sizeof(float) * kernel_size);
+	gb->width = 0;
+	gb->padded_row = NULL;
+	gb->ring = NULL;
+	gb->acc = NULL;
+	gb->next_row = 0;
+
+	if (gb->taps == NULL) {
+		fprintf(stderr, "malloc failed in gaussian_blur_init\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// exp(-(x^2 + y^2) / 2s^2) = exp(-x^2 / 2s^2) * exp(-y^2 / 2s^2),
+	// so normalizing the 1D taps gives the same kernel as create_gaussian_kernel.
+	float sum = 0.0f;
+	for (int i = 0; i < kernel_size; i++) {
+		int rel = i - gb->radius;
+		gb->taps[i] = expf(-(float)(rel * rel) / (2.0f * sigma * sigma));
+		sum += gb->taps[i];
+	}
+	for (int i = 0; i < kernel_size; i++) {
+		gb->taps[i] /= sum;
+	}
+}
+
+// (Re)allocates the row buffers when the image width changes.
+static void gaussian_blur_reserve(GaussianBlur* gb, int width) {
+	if (gb->width == width) return;
+
+	int taps = 2 * gb->radius + 1;
+
+	free(gb->padded_row);
+	free(gb->ring);
+	free(gb->acc);
+
+	gb->width = width;
+	gb->padded_row = malloc(sizeof(float) * 3 * (width + 2 * gb->radius));
+	gb->ring = malloc(sizeof(float) * 3 * width * taps);
+	gb->acc = malloc(sizeof(float) * 3 * width);
+
+	if (gb->padded_row == NULL || gb->ring == NULL || gb->acc == NULL) {
+		fprintf(stderr, "malloc failed in gaussian_blur_reserve for width %d\n", width);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Blurs one source row horizontally into dst (3 * width floats).
+static void blur_row_horizontal(GaussianBlur* gb, const Pixel* src, float* dst) {
+	int width = gb->width;
+	int radius = gb->radius;
+	int taps = 2 * radius + 1;
+	int n = 3 * width;
+	float* padded = gb->padded_row;
+
+	for (int x = -radius; x < width + radius; x++) {
+		int sx = x < 0 ? 0 : (x >= width ? width - 1 : x);
+		float* p = &padded[3 * (x + radius)];
+		p[0] = (float)src[sx].r;
+		p[1] = (float)src[sx].g;
+		p[2] = (float)src[sx].b;
+	}
+
+	// Taps outermost so the inner loop runs over contiguous pixels and vectorizes.
+	for (int i = 0; i < n; i++) dst[i] = 0.0f;
+	for (int k = 0; k < taps; k++) {
+		const float w = gb->taps[k];
+		const float* in = padded + 3 * k;
+		for (int i = 0; i < n; i++) {
+			dst[i] += w * in[i];
+		}
+	}
+}
+
+// Blurs the rows held in the ring vertically and writes output row y.
+static void blur_row_vertical(GaussianBlur* gb, int y, int height, Pixel* out) {
+	int width = gb->width;
+	int radius = gb->radius;
+	int taps = 2 * radius + 1;
+	int n = 3 * width;
+	float* acc = gb->acc;
+
+	for (int i = 0; i < n; i++) acc[i] = 0.0f;
+	for (int k = 0; k < taps; k++) {
+		int sy = y + k - radius;
+		if (sy < 0) sy = 0;
+		if (sy >= height) sy = height - 1;
+
+		const float w = gb->taps[k];
+		const float* row = gb->ring + (size_t)(sy % taps) * n;
+		for (int i = 0; i < n; i++) {
+			acc[i] += w * row[i];
+		}
+	}
+
+	for (int x = 0; x < width; x++) {
+		float r = acc[3 * x], g = acc[3 * x + 1], b = acc[3 * x + 2];
+		out[x].r = (int)(r > 255 ? 255 : (r < 0 ? 0 : r));
+		out[x].g = (int)(g > 255 ? 255 : (g < 0 ? 0 : g));
+		out[x].b = (int)(b > 255 ? 255 : (b < 0 ? 0 : b));
+	}
+}
+
+void gaussian_blur_begin(GaussianBlur* gb, int width) {
+	gaussian_blur_reserve(gb, width);
+	gb->next_row = 0;
+}
+
+void gaussian_blur_row_from(GaussianBlur* gb, BlurRowSource source, void* ctx, int height, int y, Pixel* out) {
+	int radius = gb->radius;
+	int taps = 2 * radius + 1;
+
+	// Loads the source rows up to y + radius; row y - radius - 1 and older have left the ring.
+	int last_needed = (y + radius < height) ? y + radius : height - 1;
+	while (gb->next_row <= last_needed) {
+		float* slot = gb->ring + (size_t)(gb->next_row % taps) * 3 * gb->width;
+		blur_row_horizontal(gb, source(ctx, gb->next_row), slot);
+		gb->next_row++;
+	}
+	blur_row_vertical(gb, y, height, out);
+}
+
+static const Pixel* image_row_source(void* ctx, int y) {
+	const Image* src = (const Image*)ctx;
+	return &src->pixels[(size_t)y * src->width];
+}
+
+void gaussian_blur_row(GaussianBlur* gb, const Image* src, int y, Pixel* out) {
+	gaussian_blur_row_from(gb, image_row_source, (void*)src, src->height, y, out);
+}
+
+void gaussian_blur_apply(GaussianBlur* gb, Image* img) {
+	int width = img->width;
+	int height = img->height;
+
+	if (width <= 0 || height <= 0) return;
+
+	gaussian_blur_begin(gb, width);
+
+	// Source row y is only overwritten after every output row that needs it is written,
+	// so the blur can run in place with (2 * radius + 1) rows of scratch.
+	for (int y = 0; y < height; y++) {
+		gaussian_blur_row(gb, img, y, &img->pixels[(size_t)y * width]);
+	}
+}
+
+void gaussian_blur_free(GaussianBlur* gb) {
+	free(gb->taps);
+	free(gb->padded_row);
+	free(gb->ring);
+	free(gb->acc);
+	gb->taps = NULL;
+	gb->padded_row = NULL;
+	gb->ring = NULL;
+	gb->acc = NULL;
+	gb->width = 0;
+}
+
+void gaussian_blur(Image* img, float sigma, int kernel_size) {
+	GaussianBlur gb;
+	gaussian_blur_init(&gb, sigma, kernel_size);
+	gaussian_blur_apply(&gb, img);
+	gaussian_blur_free(&gb);
+}
@@ -0,0 +1,47 @@
+#ifndef __GAUSSIAN_BLUR_H__
+#define __GAUSSIAN_BLUR_H__
+
+#include "image.h"
+
+/*
+Separable Gaussian blur.
+The 2D kernel is split into a horizontal and a vertical 1D pass.
+Horizontally blurred rows are kept in a ring of (2 * radius + 1) row buffers,
+so the image is blurred in place and only a few rows of scratch are needed.
+Borders are handled by replicating the edge pixels (clamp-to-edge).
+*/
+typedef struct {
+	int radius;
+	float* taps;        // 2 * radius + 1 normalized weights
+	int width;          // row width the buffers below are sized for
+	float* padded_row;  // one source row (r g b r g b ...) with radius replicated pixels on each side
+	float* ring;        // (2 * radius + 1) horizontally blurred rows
+	float* acc;         // vertical accumulator for one output row
+	int next_row;       // next source row gaussian_blur_row loads into the ring
+} GaussianBlur;
+
+void gaussian_blur_init(GaussianBlur* gb, float sigma, int kernel_size);
+
+void gaussian_blur_apply(GaussianBlur* gb, Image* img);
+
+/*
+Streaming form: writes blurred row y of src to out (width pixels) without touching src.
+Rows must be requested as 0, 1, 2, ..., each after gaussian_blur_begin; out may alias
+row y of src, which is how gaussian_blur_apply blurs in place.
+*/
+void gaussian_blur_begin(GaussianBlur* gb, int width);
+
+void gaussian_blur_row(GaussianBlur* gb, const Image* src, int y, Pixel* out);
+
+// Source of rows for gaussian_blur_row_from: returns row y (width pixels). The pointer only
+// has to stay valid until the next call; rows are asked for once each, in order.
+typedef const Pixel* (*BlurRowSource)(void* ctx, int y);
+
+// gaussian_blur_row for an image that is not resident, of the given height.
+void gaussian_blur_row_from(GaussianBlur* gb, BlurRowSource source, void* ctx, int height, int y, Pixel* out);
+
+void gaussian_blur_free(GaussianBlur* gb);
+
+void gaussian_blur(Image* img, float sigma, int kernel_size);
+
+#endif // !__GAUSSIAN_BLUR_H__
@@ -1,249 +1,376 @@
 #include "image.h"
 #include "image_process.h"
+#include "gaussian_blur.h"
 #include "gbs.h"
 #include "disjoint_set.h"
 #include "utils.h"
 #include "matrix.h"
+#include "simd.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 
+static inline int pixel_distance_sq(Pixel a, Pixel b) {
+	int dr = a.r - b.r;
+	int dg = a.g - b.g;
+	int db = a.b - b.b;
+	return dr * dr + dg * dg + db * db;
+}
+
 float pixel_distance(Pixel a, Pixel b) {
+	// The squared distance is an exact integer, so sqrtf rounds the same as the double sqrt did.
+	return sqrtf((float)pixel_distance_sq(a, b));
+}
 
-	float distance;
+int compact_edge_count(int width, int height) {
+	if (width <= 0 || height <= 0) return 0;
+	return (width - 1) * height				// E
+		+ 2 * (width - 1) * (height - 1)	// SW, SE
+		+ width * (height - 1);				// S
+}
 
-	distance = sqrt(
-		pow(a.r - b.r, 2) + pow(a.g - b.g, 2) + pow(a.b - b.b, 2)
-	);
+void init_compact_edges(CompactEdgeList* edges, int width, int capacity) {
+	edges->size = 0;
+	edges->width = width;
+	edges->code = malloc(sizeof(uint32_t) * (capacity > 0 ? capacity : 1));
+	edges->weight = malloc(sizeof(uint16_t) * (capacity > 0 ? capacity : 1));
 
-	return distance;
+	if (edges->code == NULL || edges->weight == NULL) {
+		fprintf(stderr, "malloc failed in init_compact_edges for %d edges\n", capacity);
+		exit(EXIT_FAILURE);
+	}
 }
 
-void init_edge_list(EdgeList* list, int capacity) {
-	list->data = (Edge*)malloc(sizeof(Edge) * capacity);
-	if (list->data == NULL) {
-		fprintf(stderr, "malloc failed in init_edge_list\n");
-		exit(EXIT_FAILURE);
+static void edge_distance_sq_scalar(const Pixel* a, const Pixel* b, int begin, int end, uint32_t* sq) {
+	for (int i = begin; i < end; i++) {
+		sq[i] = (uint32_t)pixel_distance_sq(a[i], b[i]);
 	}
-	list->size = 0;
-	list->capacity = capacity;
 }
 
+void edge_distance_sq_row(const Pixel* a, const Pixel* b, int count, uint32_t* sq) {
+	int i = 0;
+
+#ifdef SIMD_SSE2
+	// 16 pixels are 48 bytes: three loads per row, one byte lane per channel.
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= count; i += 16) {
+		uint16_t channel_sq[48];
+		const unsigned char* pa = (const unsigned char*)(a + i);
+		const unsigned char* pb = (const unsigned char*)(b + i);
+
+		for (int j = 0; j < 3; j++) {
+			__m128i va = _mm_loadu_si128((const __m128i*)(pa + 16 * j));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(pb + 16 * j));
+			__m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+
+			// |d| <= 255, so d * d <= 65025 fits an unsigned 16-bit lane.
+			__m128i lo = _mm_unpacklo_epi8(diff, zero);
+			__m128i hi = _mm_unpackhi_epi8(diff, zero);
+			_mm_storeu_si128((__m128i*)(channel_sq + 16 * j), _mm_mullo_epi16(lo, lo));
+			_mm_storeu_si128((__m128i*)(channel_sq + 16 * j + 8), _mm_mullo_epi16(hi, hi));
+		}
 
-void add_edge(EdgeList* list, int start, int end, float weight) {
-	if (list == NULL) {
-		fprintf(stderr, "Error: list is NULL in add_edge()\n");
-		exit(EXIT_FAILURE);
+		for (int j = 0; j < 16; j++) {
+			sq[i + j] = (uint32_t)channel_sq[3 * j] + channel_sq[3 * j + 1] + channel_sq[3 * j + 2];
+		}
 	}
+#endif
 
-	if (list->data == NULL) {
-		fprintf(stderr, "Error: list->data is NULL in add_edge()\n");
-		exit(EXIT_FAILURE);
-	}
+	edge_distance_sq_scalar(a, b, i, count, sq);
+}
 
-	if (list->size >= list->capacity) {
-		list->capacity *= 2;
-		Edge* new_data = (Edge*)realloc(list->data, sizeof(Edge) * list->capacity);
-		if (new_data == NULL) {
-			fprintf(stderr, "Error: realloc failed in add_edge()\n");
-			exit(EXIT_FAILURE);
+void edge_weight_row(const Pixel* a, const Pixel* b, int count, uint16_t* weights) {
+	uint32_t sq[64];
+
+	for (int start = 0; start < count; start += 64) {
+		int n = (count - start < 64) ? count - start : 64;
+		edge_distance_sq_row(a + start, b + start, n, sq);
+
+		int i = 0;
+#ifdef SIMD_SSE2
+		// Same operations as gbs_quantize_weight(sqrtf(sq)): sqrt, multiply, add, truncate.
+		const __m128 scale = _mm_set1_ps(GBS_WEIGHT_SCALE);
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128i bias = _mm_set1_epi32(32768);
+		const __m128i sign = _mm_set1_epi16((short)0x8000);
+		for (; i + 8 <= n; i += 8) {
+			__m128 lo = _mm_sqrt_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sq + i))));
+			__m128 hi = _mm_sqrt_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sq + i + 4))));
+			__m128i qlo = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(lo, scale), half));
+			__m128i qhi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(hi, scale), half));
+
+			// SSE2 only packs with signed saturation, so shift into the signed range and back.
+			__m128i packed = _mm_packs_epi32(_mm_sub_epi32(qlo, bias), _mm_sub_epi32(qhi, bias));
+			_mm_storeu_si128((__m128i*)(weights + start + i), _mm_xor_si128(packed, sign));
+		}
+#endif
+		for (; i < n; i++) {
+			weights[start + i] = gbs_quantize_weight(sqrtf((float)sq[i]));
 		}
-		list->data = new_data;
 	}
+}
 
-	list->data[list->size++] = (Edge){ start, end, weight };
+void compact_row_weights(const Pixel* row, const Pixel* next, int width, uint16_t* weights) {
+	// weights[width + x] is the edge from x to x - 1 below, weights[3 * width + x] the one to x + 1 below.
+	edge_weight_row(row, row + 1, width - 1, weights);
+	if (next != NULL) {
+		edge_weight_row(row + 1, next, width - 1, weights + width + 1);
+		edge_weight_row(row, next, width, weights + 2 * width);
+		edge_weight_row(row, next + 1, width - 1, weights + 3 * width);
+	}
 }
 
-void build_edge_graph(Image* img, EdgeList* edges) {
-	const int dx[8] = {-1, 0, 1, -1, 1, -1, 0, 1};
-	const int dy[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
+// Appends the forward edges of row y; next is row y + 1, or NULL on the last row.
+// scratch holds 4 * width weights, one run per direction.
+static void add_row_edges(CompactEdgeList* edges, const Pixel* row, const Pixel* next, int y, int width, uint16_t* scratch) {
+	const uint16_t* w_e = scratch;
+	const uint16_t* w_sw = scratch + width;
+	const uint16_t* w_s = scratch + 2 * width;
+	const uint16_t* w_se = scratch + 3 * width;
+
+	compact_row_weights(row, next, width, scratch);
+
+	uint32_t* code = edges->code + edges->size;
+	uint16_t* weight = edges->weight + edges->size;
+	int n = 0;
+
+	for (int x = 0; x < width; x++) {
+		uint32_t src = (uint32_t)(y * width + x) << 2;
+
+		// Emitted in increasing destination order.
+		if (x + 1 < width) { code[n] = src | EDGE_DIR_E; weight[n++] = w_e[x]; }
+		if (next == NULL) continue;
+		if (x > 0) { code[n] = src | EDGE_DIR_SW; weight[n++] = w_sw[x]; }
+		code[n] = src | EDGE_DIR_S; weight[n++] = w_s[x];
+		if (x + 1 < width) { code[n] = src | EDGE_DIR_SE; weight[n++] = w_se[x]; }
+	}
+	edges->size += n;
+}
 
+static uint16_t* alloc_row_scratch(int width) {
+	uint16_t* scratch = malloc(sizeof(uint16_t) * 4 * (width > 0 ? width : 1));
+	if (scratch == NULL) {
+		fprintf(stderr, "malloc failed in alloc_row_scratch for width %d\n", width);
+		exit(EXIT_FAILURE);
+	}
+	return scratch;
+}
+
+void build_compact_edges(Image* img, CompactEdgeList* edges) {
 	int width = img->width;
 	int height = img->height;
 
-	int idx, nx, ny, nidx;
-	float weight;
-	Pixel origin, neighbor;
+	init_compact_edges(edges, width, compact_edge_count(width, height));
+	uint16_t* scratch = alloc_row_scratch(width);
 
-	// loop for every pixel
 	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			idx = y * width + x;
-			origin = img->pixels[idx];
-
-			for (int i = 0; i < 8; i++) {
-				nx = x + dx[i];
-				ny = y + dy[i];
-
-				// only when pixel exists
-				if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
-					nidx = ny * width + nx;
-					neighbor = img->pixels[nidx];
-					weight = pixel_distance(origin, neighbor);
-					add_edge(edges, idx, nidx, weight);
-				}
-
-			}
-		}
+		const Pixel* row = &img->pixels[y * width];
+		const Pixel* next = (y + 1 < height) ? row + width : NULL;
+		add_row_edges(edges, row, next, y, width, scratch);
 	}
 
+	free(scratch);
 }
 
-void print_edge_list(const EdgeList* list, int count) {
-	/*
-	Print edge list for debugging
-	if cout == -1 -> see all
-	*/
+void build_compact_edges_blurred(const Image* img, float sigma, CompactEdgeList* edges) {
+	int width = img->width;
+	int height = img->height;
 
+	init_compact_edges(edges, width, compact_edge_count(width, height));
+	if (width <= 0 || height <= 0) return;
 
-	if (count == -1 || count >= list->size ) { count = list->size; }
+	GaussianBlur gb;
+	gaussian_blur_init(&gb, sigma, GBS_BLUR_KERNEL_SIZE);
+	gaussian_blur_begin(&gb, width);
 
-	printf("=== Edge List ===\n");
-	for (int i = 0; i < count; i++) {
-		const Edge e = list->data[i];
-		printf("[%d]  src=%d  dst=%d  weight=%.6f\n", i, e.start, e.end, e.weight);
+	// Two blurred rows: the edges of row y - 1 go out once row y is blurred.
+	Pixel* row = malloc(sizeof(Pixel) * width);
+	Pixel* next = malloc(sizeof(Pixel) * width);
+	uint16_t* scratch = alloc_row_scratch(width);
+	if (row == NULL || next == NULL) {
+		fprintf(stderr, "malloc failed in build_compact_edges_blurred\n");
+		exit(EXIT_FAILURE);
 	}
-	printf("Total edges: %d\n", list->size);
-}
 
-void free_edges(EdgeList* edges) {
-	free(edges->data);
-}
+	gaussian_blur_row(&gb, img, 0, row);
+	for (int y = 1; y < height; y++) {
+		gaussian_blur_row(&gb, img, y, next);
+		add_row_edges(edges, row, next, y - 1, width, scratch);
 
-int compare_edge_weight(const void* a, const void* b) {
-	const Edge* ea = (const Edge*)a;
-	const Edge* eb = (const Edge*)b;
-	if (ea->weight < eb->weight) return -1;
-	else if (ea->weight > eb->weight) return 1;
-	else return 0;
-}
+		Pixel* tmp = row;
+		row = next;
+		next = tmp;
+	}
+	add_row_edges(edges, row, NULL, height - 1, width, scratch);
 
-void sort_edge_list(EdgeList* list) {
-	// sort edges using qsort
-	qsort(list->data, list->size, sizeof(Edge), compare_edge_weight);
+	free(row);
+	free(next);
+	free(scratch);
+	gaussian_blur_free(&gb);
 }
 
-void merge_components(EdgeList* edges, DisjointSet* ds, int* size, float* internal, float k) {
-	for (int i = 0; i < edges->size; i++) {
-		Edge e = edges->data[i];
+void build_compact_edges_plane(const PlaneView* plane, CompactEdgeList* edges) {
+	int width = plane->width;
+	int height = plane->height;
+
+	init_compact_edges(edges, width, compact_edge_count(width, height));
 
-		int a = ds_find(ds, e.start);
-		int b = ds_find(ds, e.end);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int idx = y * width + x;
+			float v = (float)plane_at(plane, x, y);
+
+			if (x + 1 < width) add_compact_edge(edges, idx, EDGE_DIR_E, fabsf(v - plane_at(plane, x + 1, y)));
+			if (y + 1 >= height) continue;
+			if (x > 0) add_compact_edge(edges, idx, EDGE_DIR_SW, fabsf(v - plane_at(plane, x - 1, y + 1)));
+			add_compact_edge(edges, idx, EDGE_DIR_S, fabsf(v - plane_at(plane, x, y + 1)));
+			if (x + 1 < width) add_compact_edge(edges, idx, EDGE_DIR_SE, fabsf(v - plane_at(plane, x + 1, y + 1)));
+		}
+	}
+}
 
-		if (a == b) continue;
+void sort_compact_edges(CompactEdgeList* edges) {
+	/*
+	Stable LSD radix sort on the 16-bit weights, two 8-bit passes.
+	Edges with equal weight keep their scan order.
+	*/
 
-		float threshold_a = k / size[a];
-		float threshold_b = k / size[b];
+	int n = edges->size;
+	if (n < 2) return;
 
-		float diff_a = internal[a];
-		float diff_b = internal[b];
+	uint32_t* code_tmp = malloc(sizeof(uint32_t) * n);
+	uint16_t* weight_tmp = malloc(sizeof(uint16_t) * n);
+	if (code_tmp == NULL || weight_tmp == NULL) {
+		fprintf(stderr, "malloc failed in sort_compact_edges\n");
+		exit(EXIT_FAILURE);
+	}
 
-		float threshold = fminf(diff_a + threshold_a, diff_b + threshold_b);
+	uint32_t* code_src = edges->code;
+	uint16_t* weight_src = edges->weight;
+	uint32_t* code_dst = code_tmp;
+	uint16_t* weight_dst = weight_tmp;
 
-		if (e.weight <= threshold) {
-			ds_union(ds, a, b);
-			int new_root = ds_find(ds, a);
+	for (int shift = 0; shift < 16; shift += 8) {
+		int offsets[257] = { 0 };
 
-			size[new_root] = size[a] + size[b];
-			internal[new_root] = fmaxf(e.weight, fmaxf(diff_a, diff_b));
+		for (int i = 0; i < n; i++) {
+			offsets[((weight_src[i] >> shift) & 0xFF) + 1]++;
 		}
+		for (int b = 0; b < 256; b++) {
+			offsets[b + 1] += offsets[b];
+		}
+		for (int i = 0; i < n; i++) {
+			int pos = offsets[(weight_src[i] >> shift) & 0xFF]++;
+			code_dst[pos] = code_src[i];
+			weight_dst[pos] = weight_src[i];
+		}
+
+		uint32_t* code_swap = code_src; code_src = code_dst; code_dst = code_swap;
+		uint16_t* weight_swap = weight_src; weight_src = weight_dst; weight_dst = weight_swap;
 	}
+
+	// After an even number of passes the result is back in the original arrays.
+	free(code_tmp);
+	free(weight_tmp);
 }
 
+void free_compact_edges(CompactEdgeList* edges) {
+	free(edges->code);
+	free(edges->weight);
+	edges->code = NULL;
+	edges->weight = NULL;
+	edges->size = 0;
+}
 
-void graph_based_segmentation(DisjointSet* ds, Image* img, float k, float sigma) {
-	
-	EdgeList edges;
-	Matrix gaussian;
+void merge_components_compact(const CompactEdgeList* edges, DisjointSet* ds, float k) {
+	for (int i = 0; i < edges->size; i++) {
+		gbs_try_merge(ds, compact_edge_source(edges, i), compact_edge_target(edges, i), compact_edge_weight(edges, i), k);
+	}
+}
 
-	int pixel_count = img->width*img->height;
-	int* size = malloc(sizeof(int) * pixel_count);
-	float* internal = malloc(sizeof(float) * pixel_count);
+// Felzenszwalb's post-processing pass: walks the sorted edges again and joins every pair of
+// components where one side is still smaller than min_size, so each small component goes to
+// its most similar neighbour. Returns the number of components merged away.
+int enforce_min_region_size(const CompactEdgeList* sorted_edges, DisjointSet* ds, int min_size) {
+	if (min_size <= 1) return 0;
 
-	int kernel_size = 5;
-	if (kernel_size % 2 == 0) {
-		printf("Caution: Automaticaaly change kernel size: %d -> %d\n", kernel_size, ++kernel_size);
+	int merged = 0;
+	for (int i = 0; i < sorted_edges->size; i++) {
+		merged += gbs_try_join_small(ds, compact_edge_source(sorted_edges, i), compact_edge_target(sorted_edges, i),
+			compact_edge_weight(sorted_edges, i), min_size);
 	}
+	return merged;
+}
 
-	gaussian = create_gaussian_kernel(kernel_size, sigma);
-
-	apply_kernel(img, &gaussian);
+int graph_based_segmentation(DisjointSet* ds, const Image* img, float k, float sigma, int min_size) {
+	
+	CompactEdgeList edges;
 
 	//contrast_stretch(img, 0.5);
 
-	for (int i = 0; i < pixel_count; i++) {
-		size[i] = 1;
-		internal[i] = 0.0f;
-	}
-
-	init_edge_list(&edges, 100);
-
-	build_edge_graph(img, &edges);
+	build_compact_edges_blurred(img, sigma, &edges);
 	
-	sort_edge_list(&edges);
+	sort_compact_edges(&edges);
 
 	ds_init(ds, img->width * img->height);
 
-	merge_components(&edges, ds, size, internal, k);
+	merge_components_compact(&edges, ds, k);
 
-	free_edges(&edges);
-	free_matrix(&gaussian);
-	free(size);
-	free(internal);
-}
+	int merged = enforce_min_region_size(&edges, ds, min_size);
 
-// Calculates the distance between two pixels in a 1-channel (grayscale) image.
-float pixel_distance_gray(Pixel a, Pixel b) {
-	// Uses the R channel to calculate the absolute difference as the distance.
-	return fabsf((float)a.r - (float)b.r);
+	free_compact_edges(&edges);
+	return merged;
 }
 
-// Builds an edge graph for a 1-channel image.
-void build_edge_graph_gray(Image* img, EdgeList* edges) {
-	const int dx[4] = { 1, 0, 1, 1 }; // Considers only 4 directions, not 8.
-	const int dy[4] = { 0, 1, -1, 1 };
+// Performs Graph-Based Segmentation on a single 8-bit plane (no blur).
+int graph_based_segmentation_plane(DisjointSet* ds, const PlaneView* plane, float k, int min_size) {
+	CompactEdgeList edges;
+	int pixel_count = plane->width * plane->height;
 
-	int width = img->width;
-	int height = img->height;
+	build_compact_edges_plane(plane, &edges);
+	sort_compact_edges(&edges);
+	ds_init(ds, pixel_count);
 
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			int idx1 = y * width + x;
-			for (int i = 0; i < 4; i++) {
-				int nx = x + dx[i];
-				int ny = y + dy[i];
-				if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
-					int idx2 = ny * width + nx;
-					float weight = pixel_distance_gray(img->pixels[idx1], img->pixels[idx2]);
-					add_edge(edges, idx1, idx2, weight);
-				}
-			}
-		}
-	}
+	merge_components_compact(&edges, ds, k);
+
+	int merged = enforce_min_region_size(&edges, ds, min_size);
+
+	free_compact_edges(&edges);
+	return merged;
 }
 
-// Performs Graph-Based Segmentation on a 1-channel (grayscale) image.
-void graph_based_segmentation_grayscale(DisjointSet* ds, Image* img, float k) {
-	EdgeList edges;
-	int pixel_count = img->width * img->height;
-	int* size = malloc(sizeof(int) * pixel_count);
-	float* internal = malloc(sizeof(float) * pixel_count);
+// Performs Graph-Based Segmentation with an edge list that is already built and sorted.
+int graph_based_segmentation_edges(DisjointSet* ds, const CompactEdgeList* sorted_edges, int pixel_count, float k, int min_size) {
+	ds_init(ds, pixel_count);
+	merge_components_compact(sorted_edges, ds, k);
+	return enforce_min_region_size(sorted_edges, ds, min_size);
+}
 
-	for (int i = 0; i < pixel_count; i++) {
-		size[i] = 1;
-		internal[i] = 0.0f;
+// Runs the merge once per k over the same sorted edges, one k per OpenMP iteration.
+// Each k has its own DisjointSet, so the scans share nothing but the read-only edges.
+void graph_based_segmentation_edges_sweep(DisjointSet* ds_out, const CompactEdgeList* sorted_edges, int pixel_count, const float* ks, int k_count, int min_size) {
+#pragma omp parallel for schedule(dynamic, 1) if(k_count > 1)
+	for (int i = 0; i < k_count; i++) {
+		graph_based_segmentation_edges(&ds_out[i], sorted_edges, pixel_count, ks[i], min_size);
 	}
+}
 
-	init_edge_list(&edges, pixel_count * 2); // Initializes with a larger buffer.
-	build_edge_graph_gray(img, &edges);
-	sort_edge_list(&edges);
-	ds_init(ds, pixel_count);
+// graph_based_segmentation for several k: blurs and builds the edges and sorts them once.
+void graph_based_segmentation_sweep(DisjointSet* ds_out, const Image* img, const float* ks, int k_count, float sigma, int min_size) {
+	CompactEdgeList edges;
+
+	build_compact_edges_blurred(img, sigma, &edges);
 
-	// merge_components is used as is (no changes needed).
-	merge_components(&edges, ds, size, internal, k);
+	sort_compact_edges(&edges);
 
-	free_edges(&edges);
-	free(size);
-	free(internal);
-}
\ No newline at end of file
+	graph_based_segmentation_edges_sweep(ds_out, &edges, img->width * img->height, ks, k_count, min_size);
+
+	free_compact_edges(&edges);
+}
+
+// Performs Graph-Based Segmentation on a 1-channel (grayscale) image stored in the R channel.
+int graph_based_segmentation_grayscale(DisjointSet* ds, Image* img, float k, int min_size) {
+	PlaneView plane = image_plane(img, 0);
+	return graph_based_segmentation_plane(ds, &plane, k, min_size);
+}
@@ -4,43 +4,223 @@
 #include "image.h"
 #include "disjoint_set.h"
 #include "selective_search.h"
+#include "row_reader.h"
 
 #include <stdio.h>
-
-typedef struct {
-	int start;
-	int end;
-	float weight;
-} Edge;
-
+#include <stdint.h>
+#include <math.h>
+
+// Size of the Gaussian kernel graph_based_segmentation blurs with (odd).
+#define GBS_BLUR_KERNEL_SIZE 5
+
+// Upper bound of the RGB edge weights, used to size the weight buckets.
+#define GBS_MAX_WEIGHT_RGB  441.673f	// sqrt(3 * 255^2)
+
+// Quantization of compact edge weights: weight = q / GBS_WEIGHT_SCALE.
+// 441.7 * 128 still fits in 16 bits, and integer grayscale distances stay exact.
+#define GBS_WEIGHT_SCALE 128.0f
+
+/*
+Forward neighbours of a pixel. Every undirected 8-neighbour edge is stored once,
+from the pixel that comes first in scan order.
+*/
+typedef enum {
+	EDGE_DIR_E,		// (x + 1, y)
+	EDGE_DIR_SW,	// (x - 1, y + 1)
+	EDGE_DIR_S,		// (x, y + 1)
+	EDGE_DIR_SE		// (x + 1, y + 1)
+} EdgeDirection;
+
+/*
+Structure-of-arrays edge store.
+code[i] = (source pixel << 2) | EdgeDirection, so images are limited to 2^30 pixels.
+The destination is implied by the direction and the image width.
+*/
 typedef struct {
-	Edge* data;
+	uint32_t* code;
+	uint16_t* weight;
 	int size;
-	int capacity;
-} EdgeList;
+	int width;
+} CompactEdgeList;
 
 float pixel_distance(Pixel a, Pixel b);
 
-void init_edge_list(EdgeList* list, int capacity);
+/*
+Felzenszwalb merge rule: join the components of x and y when weight is no larger than
+min(Int(A) + k / |A|, Int(B) + k / |B|). Size and internal difference live in the root
+DSNode, so every edge touches one record per endpoint.
+Edges must be visited in non-decreasing weight order. Returns 1 when a merge happened.
+*/
+static inline int gbs_try_merge(DisjointSet* ds, int x, int y, float weight, float k) {
+	int a = ds_find(ds, x);
+	int b = ds_find(ds, y);
+
+	if (a == b) return 0;
+
+	DSNode* na = &ds->nodes[a];
+	DSNode* nb = &ds->nodes[b];
+
+	float threshold = fminf(na->internal + k / na->size, nb->internal + k / nb->size);
+	if (weight > threshold) return 0;
+
+	float internal = fmaxf(weight, fmaxf(na->internal, nb->internal));
+	int root = ds_union(ds, a, b);
+	ds->nodes[root].internal = internal;
+	return 1;
+}
+
+// Small-component rule of enforce_min_region_size: join the components of x and y when
+// either has fewer than min_size pixels. Returns 1 when a merge happened.
+static inline int gbs_try_join_small(DisjointSet* ds, int x, int y, float weight, int min_size) {
+	int a = ds_find(ds, x);
+	int b = ds_find(ds, y);
+
+	if (a == b) return 0;
+	if (ds->nodes[a].size >= min_size && ds->nodes[b].size >= min_size) return 0;
+
+	float internal = fmaxf(weight, fmaxf(ds->nodes[a].internal, ds->nodes[b].internal));
+	int root = ds_union(ds, a, b);
+	ds->nodes[root].internal = internal;
+	return 1;
+}
+
+int compact_edge_count(int width, int height);
+
+void init_compact_edges(CompactEdgeList* edges, int width, int capacity);
+
+static inline uint16_t gbs_quantize_weight(float weight) {
+	return (uint16_t)(weight * GBS_WEIGHT_SCALE + 0.5f);
+}
+
+// Appends an edge; the caller sizes the list with init_compact_edges.
+static inline void add_compact_edge(CompactEdgeList* edges, int src, EdgeDirection dir, float weight) {
+	edges->code[edges->size] = ((uint32_t)src << 2) | (uint32_t)dir;
+	edges->weight[edges->size] = gbs_quantize_weight(weight);
+	edges->size++;
+}
+
+/*
+Row kernels behind build_compact_edges, SSE2 where available.
+edge_distance_sq_row writes the exact squared RGB distance of a[i] and b[i]. It is a
+monotone sort key for pixel_distance that needs no square root.
+edge_weight_row writes gbs_quantize_weight(pixel_distance(a[i], b[i])), bit for bit.
+*/
+void edge_distance_sq_row(const Pixel* a, const Pixel* b, int count, uint32_t* sq);
+
+void edge_weight_row(const Pixel* a, const Pixel* b, int count, uint16_t* weights);
+
+// Quantized weights of the forward edges of one row, as four runs of width values:
+// E, SW, S, SE. next is the row below, or NULL on the last row (then only E is written).
+void compact_row_weights(const Pixel* row, const Pixel* next, int width, uint16_t* weights);
 
-void add_edge(EdgeList* list, int start, int end, float weight);
+void build_compact_edges(Image* img, CompactEdgeList* edges);
 
-void build_edge_graph(Image* img, EdgeList* edges);
+// build_compact_edges on img blurred with sigma, without blurring img itself.
+// The blur streams through a few rows of scratch and the edges of each row are emitted
+// as soon as the row below it is blurred, so no blurred copy of the image is made.
+void build_compact_edges_blurred(const Image* img, float sigma, CompactEdgeList* edges);
 
-void free_edges(EdgeList* edges);
+void build_compact_edges_plane(const PlaneView* plane, CompactEdgeList* edges);
 
-void print_edge_list(const EdgeList* list, int count);
+void sort_compact_edges(CompactEdgeList* edges);
 
-int compare_edge_weight(const void* a, const void* b);
+void free_compact_edges(CompactEdgeList* edges);
 
-void sort_edge_list(EdgeList* list);
+static inline int compact_edge_source(const CompactEdgeList* edges, int i) {
+	return (int)(edges->code[i] >> 2);
+}
 
-void merge_components(EdgeList* edges, DisjointSet* ds, int* size, float* internal, float k);
+static inline int compact_edge_target(const CompactEdgeList* edges, int i) {
+	uint32_t code = edges->code[i];
+	int src = (int)(code >> 2);
+	switch (code & 3) {
+	case EDGE_DIR_E: return src + 1;
+	case EDGE_DIR_SW: return src + edges->width - 1;
+	case EDGE_DIR_S: return src + edges->width;
+	default: return src + edges->width + 1;
+	}
+}
 
-void graph_based_segmentation(DisjointSet* ds, Image* img, float k, float sigma);
+static inline float compact_edge_weight(const CompactEdgeList* edges, int i) {
+	return edges->weight[i] * (1.0f / GBS_WEIGHT_SCALE);
+}
 
-void graph_based_segmentation_grayscale(DisjointSet* ds, Image* img, float k);
+void merge_components_compact(const CompactEdgeList* edges, DisjointSet* ds, float k);
+
+// Smallest component size GBS leaves behind by default; smaller components are joined
+// to a neighbour by enforce_min_region_size. 0 or 1 disables the pass.
+#define GBS_MIN_REGION_SIZE 20
 
-void enforce_min_region_size(RegionList* rl, DisjointSet* ds, int min_size);
+// Second pass over the sorted edges that joins components smaller than min_size.
+// Returns the number of components merged away.
+int enforce_min_region_size(const CompactEdgeList* sorted_edges, DisjointSet* ds, int min_size);
+
+// The segmentation functions return how many components the min_size pass removed.
+int graph_based_segmentation(DisjointSet* ds, const Image* img, float k, float sigma, int min_size);
+
+int graph_based_segmentation_plane(DisjointSet* ds, const PlaneView* plane, float k, int min_size);
+
+int graph_based_segmentation_grayscale(DisjointSet* ds, Image* img, float k, int min_size);
+
+// Segments with an already built and sorted edge list, so one list can serve several k.
+int graph_based_segmentation_edges(DisjointSet* ds, const CompactEdgeList* sorted_edges, int pixel_count, float k, int min_size);
+
+// k sweeps: ds_out[i] receives the segmentation for ks[i]. The edges are built and sorted
+// once and the k_count merges run in parallel.
+void graph_based_segmentation_edges_sweep(DisjointSet* ds_out, const CompactEdgeList* sorted_edges, int pixel_count, const float* ks, int k_count, int min_size);
+
+void graph_based_segmentation_sweep(DisjointSet* ds_out, const Image* img, const float* ks, int k_count, float sigma, int min_size);
+
+// Default tile edge length for graph_based_segmentation_tiled.
+#define GBS_TILE_SIZE 512
+
+// Tiled, multi-threaded variant of graph_based_segmentation (gbs_tiled.c).
+// Tiles are blurred and their edges built and sorted in parallel; the sorted tile lists are
+// then merged into the serial edge order, so the result equals graph_based_segmentation.
+// tile_size <= 0 selects GBS_TILE_SIZE. Returns what the min_size pass merged away.
+int graph_based_segmentation_tiled(DisjointSet* ds, const Image* img, float k, float sigma, int min_size, int tile_size);
+
+// Pixels whose label differs between two segmentations of the same image, after matching
+// every component to the one it overlaps most. The array form takes per-pixel labels.
+int gbs_label_drift(DisjointSet* reference, DisjointSet* other);
+int gbs_label_array_drift(const int* reference, const int* other, int n);
+
+/*
+Bucket-queue variant of graph_based_segmentation (gbs_buckets.c), same labels.
+The edge list is never stored with its weights or sorted: one streaming pass counts the
+edges of every quantized weight, a second one scatters their 32-bit codes into place,
+and the merges read the buckets in order. Peak edge scratch is 4 bytes per edge plus
+the bucket table, against 6 bytes per edge plus a 6-byte-per-edge sort buffer.
+*/
+int graph_based_segmentation_buckets(DisjointSet* ds, const Image* img, float k, float sigma, int min_size);
+
+// Default band height and lookahead rows for graph_based_segmentation_bands.
+#define GBS_BAND_HEIGHT 256
+#define GBS_BAND_LOOKAHEAD 128
+
+// A finished component of the band-streaming segmentation.
+typedef struct {
+	int label;              // 0, 1, 2, ... in the order regions are finished
+	int size;
+	RegionBounds bounds;
+	long long sum_r, sum_g, sum_b;  // of the unblurred pixels
+} BandRegion;
+
+typedef void (*BandRegionSink)(void* ctx, const BandRegion* region);
+
+/*
+Band-streaming variant of graph_based_segmentation (gbs_bands.c) for images larger than memory.
+Rows come from reader and are segmented band_height at a time, each band together with the
+next lookahead rows. Only the components on the last row of a band are carried to the next
+one, and every other component is handed to sink as soon as it can no longer grow, so memory
+is set by band_height + lookahead and the width. band_height < 1 selects GBS_BAND_HEIGHT and
+lookahead < 0 selects GBS_BAND_LOOKAHEAD.
+With several bands the regions drift from graph_based_segmentation, less so with more
+lookahead (band_stream_test bounds it); a single band gives the same result.
+labels is optional: when not NULL it receives the BandRegion label of every pixel, which
+needs width * height ints and so is meant for measuring that drift, not for streaming.
+Returns the number of regions emitted, or -1 if the reader failed.
+*/
+int graph_based_segmentation_bands(RowReader* reader, float k, float sigma, int band_height, int lookahead, BandRegionSink sink, void* sink_ctx, int* labels);
 
 #endif // !__GBS__
@@ -0,0 +1,328 @@
+#include "image.h"
+#include "gaussian_blur.h"
+#include "gbs.h"
+#include "disjoint_set.h"
+#include "row_reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+Band-streaming graph based segmentation.
+The image is read top to bottom and segmented band_height rows at a time:
+1. The band is blurred as it streams in, together with the lookahead rows below it.
+2. The components still touching the previous band's last row (the only ones a later row
+   can reach) are carried in as single nodes with their size and internal difference.
+3. The band's edges and the seam edges from that last row are merged as one list in weight
+   order, so a seam edge is tried before the heavier edges inside the band, as in the serial
+   scan.
+4. Components that do not touch the band's last row can no longer grow. They are
+   reported to the sink and forgotten; only the last row's components are carried on.
+   The lookahead rows only inform the merges above them and are segmented again next band.
+Nothing is ever sized by the image height, so peak memory is set by the window
+(band_height + lookahead) and the width.
+Unlike gbs_tiled.c, which merges its sorted tile lists back into the serial edge order, a
+band is merged before the rows further down are read. A component cut off at the bottom of
+the window is smaller than in graph_based_segmentation, so k / size lets it merge over
+heavier edges, and the larger internal difference it carries on lets it swallow what lies
+below. The lookahead rows keep that cut away from the rows that are final; without them
+narrow bands collapse into a few huge regions. The drift from graph_based_segmentation
+shrinks as the lookahead grows, and with band_height >= height the result is the same.
+*/
+
+// Source rows for the blur, kept in a ring so the band being segmented can still read
+// the unblurred colours for its statistics after the blur has read ahead.
+typedef struct {
+	RowReader* reader;
+	Pixel* ring;
+	int ring_rows;
+	int failed;
+} BandSource;
+
+static const Pixel* band_source_row(void* ctx, int y) {
+	BandSource* src = (BandSource*)ctx;
+	Pixel* row = src->ring + (size_t)(y % src->ring_rows) * src->reader->width;
+	if (!src->failed && !src->reader->read_row(src->reader, y, row)) {
+		fprintf(stderr, "Failed to read row %d in graph_based_segmentation_bands\n", y);
+		src->failed = 1;
+	}
+	if (src->failed) memset(row, 0, sizeof(Pixel) * src->reader->width);
+	return row;
+}
+
+static const Pixel* band_source_peek(const BandSource* src, int y) {
+	return src->ring + (size_t)(y % src->ring_rows) * src->reader->width;
+}
+
+typedef struct {
+	uint16_t weight;
+	int a, b;  // component table indices
+	int order; // scan order, for ties
+} SeamEdge;
+
+static int compare_seam_edge(const void* p, const void* q) {
+	const SeamEdge* x = (const SeamEdge*)p;
+	const SeamEdge* y = (const SeamEdge*)q;
+	if (x->weight != y->weight) return (x->weight < y->weight) ? -1 : 1;
+	return x->order - y->order;
+}
+
+static void add_seam_edge(SeamEdge* seam, int* count, uint16_t weight, int a, int b) {
+	SeamEdge* e = &seam[*count];
+	e->weight = weight;
+	e->a = a;
+	e->b = b;
+	e->order = *count;
+	(*count)++;
+}
+
+static void init_band_region(BandRegion* r) {
+	memset(r, 0, sizeof(BandRegion));
+	r->bounds.min_x = r->bounds.min_y = 0x7fffffff;
+	r->bounds.max_x = r->bounds.max_y = -1;
+}
+
+static void merge_band_region(BandRegion* into, const BandRegion* from) {
+	into->size += from->size;
+	into->sum_r += from->sum_r;
+	into->sum_g += from->sum_g;
+	into->sum_b += from->sum_b;
+	if (from->bounds.min_x < into->bounds.min_x) into->bounds.min_x = from->bounds.min_x;
+	if (from->bounds.min_y < into->bounds.min_y) into->bounds.min_y = from->bounds.min_y;
+	if (from->bounds.max_x > into->bounds.max_x) into->bounds.max_x = from->bounds.max_x;
+	if (from->bounds.max_y > into->bounds.max_y) into->bounds.max_y = from->bounds.max_y;
+}
+
+static void* band_alloc(size_t bytes) {
+	void* p = malloc(bytes > 0 ? bytes : 1);
+	if (p == NULL) {
+		fprintf(stderr, "malloc failed in graph_based_segmentation_bands for %zu bytes\n", bytes);
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/*
+Optional per-pixel labels. Every carried entry and every component of every band gets a
+global id, pixels are written with the id of their component, and each id records where it
+ended up: the region label once emitted, or the id it continues as in the next band, which
+is always a larger id. Resolving from the last id down then settles every chain in one pass.
+*/
+typedef struct {
+	int* resolve;  // >= 0: region label, < 0: -(forwarded id) - 1
+	int count;
+	int capacity;
+} BandLabelMap;
+
+static void band_label_map_reserve(BandLabelMap* map, int count) {
+	if (count <= map->capacity) return;
+	int capacity = map->capacity ? map->capacity : 1024;
+	while (capacity < count) capacity *= 2;
+	int* resolve = (int*)realloc(map->resolve, sizeof(int) * capacity);
+	if (resolve == NULL) {
+		fprintf(stderr, "realloc failed in graph_based_segmentation_bands\n");
+		exit(EXIT_FAILURE);
+	}
+	map->resolve = resolve;
+	map->capacity = capacity;
+}
+
+static void band_label_map_apply(BandLabelMap* map, int* labels, size_t pixel_count) {
+	for (int id = map->count - 1; id >= 0; id--) {
+		if (map->resolve[id] < 0) map->resolve[id] = map->resolve[-map->resolve[id] - 1];
+	}
+	for (size_t p = 0; p < pixel_count; p++) labels[p] = map->resolve[labels[p]];
+}
+
+int graph_based_segmentation_bands(RowReader* reader, float k, float sigma, int band_height, int lookahead, BandRegionSink sink, void* sink_ctx, int* labels) {
+	int width = reader->width;
+	int height = reader->height;
+	if (width <= 0 || height <= 0) return 0;
+	if (band_height < 1) band_height = GBS_BAND_HEIGHT;
+	if (band_height > height) band_height = height;
+	if (lookahead < 0) lookahead = GBS_BAND_LOOKAHEAD;
+	if (lookahead > height - band_height) lookahead = height - band_height;
+	int window_rows = band_height + lookahead;
+
+	GaussianBlur gb;
+	gaussian_blur_init(&gb, sigma, GBS_BLUR_KERNEL_SIZE);
+	gaussian_blur_begin(&gb, width);
+
+	BandSource source;
+	source.reader = reader;
+	source.ring_rows = window_rows + 2 * gb.radius + 1;
+	source.ring = band_alloc(sizeof(Pixel) * source.ring_rows * width);
+	source.failed = 0;
+
+	Pixel* band = band_alloc(sizeof(Pixel) * window_rows * width);           // blurred band, then its lookahead rows
+	int* band_labels = band_alloc(sizeof(int) * (window_rows + 1) * width);  // carried entries, then pixels
+	Pixel* boundary_row = band_alloc(sizeof(Pixel) * width);  // blurred last row of the previous band
+	int* boundary_label = band_alloc(sizeof(int) * width);    // its component table indices
+	SeamEdge* seam = band_alloc(sizeof(SeamEdge) * 3 * width);
+	uint16_t* seam_weights = band_alloc(sizeof(uint16_t) * 4 * width);
+
+	// Components carried over from the previous band; they are the first nodes of the next band's set.
+	int carried = 0;
+	DSNode* carried_nodes = band_alloc(sizeof(DSNode) * width);
+	BandRegion* carried_stats = band_alloc(sizeof(BandRegion) * width);
+
+	int emitted = 0;
+	BandLabelMap label_map = { NULL, 0, 0 };
+
+	int blurred = 0;  // rows at the top of band that the previous band blurred as its lookahead
+
+	for (int y0 = 0; y0 < height; y0 += band_height) {
+		int rows = (y0 + band_height <= height) ? band_height : height - y0;
+		int ahead = (height - y0 - rows < lookahead) ? height - y0 - rows : lookahead;
+		int pixels = rows * width;
+		int window_pixels = (rows + ahead) * width;
+
+		// 1. Blur the band and its lookahead rows, and sort their edges.
+		for (int y = blurred; y < rows + ahead; y++) {
+			gaussian_blur_row_from(&gb, band_source_row, &source, height, y0 + y, &band[(size_t)y * width]);
+		}
+
+		Image band_img;
+		band_img.width = width;
+		band_img.height = rows + ahead;
+		band_img.channels = 3;
+		band_img.pixels = band;
+
+		CompactEdgeList edges;
+		build_compact_edges(&band_img, &edges);
+		sort_compact_edges(&edges);
+
+		// 2. Disjoint set over the carried components, then the band's pixels.
+		DisjointSet band_ds;
+		ds_init(&band_ds, carried + window_pixels);
+		for (int i = 0; i < carried; i++) {
+			band_ds.nodes[i].size = carried_nodes[i].size;
+			band_ds.nodes[i].internal = carried_nodes[i].internal;
+		}
+
+		// 3. Seam edges from the previous band's last row, in weight order and then scan order.
+		int seam_count = 0;
+		if (y0 > 0) {
+			compact_row_weights(boundary_row, band, width, seam_weights);
+			for (int x = 0; x < width; x++) {
+				int a = boundary_label[x];
+				if (x > 0) add_seam_edge(seam, &seam_count, seam_weights[width + x], a, carried + x - 1);
+				add_seam_edge(seam, &seam_count, seam_weights[2 * width + x], a, carried + x);
+				if (x + 1 < width) add_seam_edge(seam, &seam_count, seam_weights[3 * width + x], a, carried + x + 1);
+			}
+			qsort(seam, seam_count, sizeof(SeamEdge), compare_seam_edge);
+		}
+
+		// 4. Band and seam edges are merged as one weight-ordered list. A seam edge starts on
+		//    the row above, so it comes first among equal weights, as in the serial scan order.
+		int s = 0;
+		for (int i = 0; i < edges.size; i++) {
+			for (; s < seam_count && seam[s].weight <= edges.weight[i]; s++) {
+				gbs_try_merge(&band_ds, seam[s].a, seam[s].b, seam[s].weight * (1.0f / GBS_WEIGHT_SCALE), k);
+			}
+			gbs_try_merge(&band_ds, carried + compact_edge_source(&edges, i), carried + compact_edge_target(&edges, i),
+				compact_edge_weight(&edges, i), k);
+		}
+		for (; s < seam_count; s++) {
+			gbs_try_merge(&band_ds, seam[s].a, seam[s].b, seam[s].weight * (1.0f / GBS_WEIGHT_SCALE), k);
+		}
+		free_compact_edges(&edges);
+
+		// 5. Statistics per component, the carried ones included. Lookahead pixels are left out:
+		//    they are segmented again as part of the next band.
+		int table_size = ds_flatten(&band_ds, band_labels);
+		BandRegion* stats = band_alloc(sizeof(BandRegion) * table_size);
+		int* open_index = band_alloc(sizeof(int) * table_size);  // carried index, -1 when final
+		for (int c = 0; c < table_size; c++) {
+			init_band_region(&stats[c]);
+			open_index[c] = -1;
+		}
+		for (int i = 0; i < carried; i++) merge_band_region(&stats[band_labels[i]], &carried_stats[i]);
+
+		int id_base = label_map.count;  // global id of carried entry 0; components follow
+		if (labels != NULL) band_label_map_reserve(&label_map, id_base + carried + table_size);
+
+		for (int p = 0; p < pixels; p++) {
+			int c = band_labels[carried + p];
+			if (labels != NULL) labels[(size_t)y0 * width + p] = id_base + carried + c;
+
+			int x = p % width;
+			int y = y0 + p / width;
+			const Pixel* src = &band_source_peek(&source, y)[x];
+			BandRegion* r = &stats[c];
+			r->size++;
+			r->sum_r += src->r;
+			r->sum_g += src->g;
+			r->sum_b += src->b;
+			if (x < r->bounds.min_x) r->bounds.min_x = x;
+			if (y < r->bounds.min_y) r->bounds.min_y = y;
+			if (x > r->bounds.max_x) r->bounds.max_x = x;
+			if (y > r->bounds.max_y) r->bounds.max_y = y;
+		}
+
+		// 6. Components on the band's last row stay open; everything else is final. An edge only
+		//    spans adjacent rows, so a component reaching into the lookahead rows is open too.
+		int last_band = (y0 + rows == height);
+		int next_carried = 0;
+		if (!last_band) {
+			const int* last_labels = band_labels + carried + (size_t)(rows - 1) * width;
+			for (int x = 0; x < width; x++) {
+				int c = last_labels[x];
+				if (open_index[c] < 0) {
+					open_index[c] = next_carried;
+					carried_nodes[next_carried] = band_ds.nodes[ds_find(&band_ds, carried + (rows - 1) * width + x)];
+					carried_nodes[next_carried].size = stats[c].size;
+					carried_stats[next_carried] = stats[c];
+					next_carried++;
+				}
+				boundary_label[x] = open_index[c];
+			}
+			memcpy(boundary_row, band + (size_t)(rows - 1) * width, sizeof(Pixel) * width);
+		}
+
+		for (int c = 0; c < table_size; c++) {
+			if (open_index[c] >= 0 || stats[c].size == 0) continue;  // open, or lookahead pixels only
+			stats[c].label = emitted++;
+			if (sink != NULL) sink(sink_ctx, &stats[c]);
+		}
+
+		if (labels != NULL) {
+			int next_base = id_base + carried + table_size;
+			for (int i = 0; i < carried; i++) {
+				label_map.resolve[id_base + i] = -(id_base + carried + band_labels[i]) - 1;
+			}
+			for (int c = 0; c < table_size; c++) {
+				label_map.resolve[id_base + carried + c] = (open_index[c] >= 0) ? -(next_base + open_index[c]) - 1 : stats[c].label;
+			}
+			label_map.count = next_base;
+		}
+
+		free(stats);
+		free(open_index);
+		ds_free(&band_ds);
+
+		// The lookahead rows are the first rows of the next band.
+		memmove(band, band + pixels, sizeof(Pixel) * ahead * width);
+		blurred = ahead;
+
+		carried = next_carried;
+	}
+
+	free(source.ring);
+	free(band);
+	free(band_labels);
+	free(boundary_row);
+	free(boundary_label);
+	free(seam);
+	free(seam_weights);
+	free(carried_nodes);
+	free(carried_stats);
+	gaussian_blur_free(&gb);
+
+	if (labels != NULL) band_label_map_apply(&label_map, labels, (size_t)width * height);
+	free(label_map.resolve);
+
+	return source.failed ? -1 : emitted;
+}
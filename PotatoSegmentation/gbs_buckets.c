@@ -0,0 +1,156 @@
+#include "image.h"
+#include "gaussian_blur.h"
+#include "gbs.h"
+#include "disjoint_set.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+/*
+Bucket-queue graph based segmentation.
+Quantized weights are small integers, so the edges can be ordered by counting instead of sorting:
+1. Stream the blurred rows and count the edges of every weight.
+2. Prefix-sum the counts into bucket offsets.
+3. Stream the rows again and write each edge code to the next free slot of its bucket.
+Edges are visited in scan order both times, so every bucket keeps scan order and the merge
+sees exactly the sequence sort_compact_edges produces.
+Weights are recomputed in the second pass rather than stored, and the blurred image is
+never stored either; only the codes and one offset per bucket stay in memory.
+*/
+
+typedef enum {
+	BUCKET_PASS_COUNT,
+	BUCKET_PASS_SCATTER
+} BucketPass;
+
+// Streams the forward edges of the blurred image in scan order. The count pass adds one to
+// offsets[w] per edge; the scatter pass writes the edge to codes[offsets[w]++].
+static void stream_bucket_edges(const Image* img, float sigma, BucketPass pass, size_t* offsets, uint32_t* codes) {
+	int width = img->width;
+	int height = img->height;
+
+	GaussianBlur gb;
+	gaussian_blur_init(&gb, sigma, GBS_BLUR_KERNEL_SIZE);
+	gaussian_blur_begin(&gb, width);
+
+	Pixel* row = malloc(sizeof(Pixel) * width);
+	Pixel* next = malloc(sizeof(Pixel) * width);
+	uint16_t* weights = malloc(sizeof(uint16_t) * 4 * width);
+	if (row == NULL || next == NULL || weights == NULL) {
+		fprintf(stderr, "malloc failed in stream_bucket_edges for width %d\n", width);
+		exit(EXIT_FAILURE);
+	}
+
+	gaussian_blur_row(&gb, img, 0, row);
+	for (int y = 0; y < height; y++) {
+		int last = (y + 1 == height);
+		if (!last) gaussian_blur_row(&gb, img, y + 1, next);
+
+		compact_row_weights(row, last ? NULL : next, width, weights);
+		const uint16_t* w_e = weights;
+		const uint16_t* w_sw = weights + width;
+		const uint16_t* w_s = weights + 2 * width;
+		const uint16_t* w_se = weights + 3 * width;
+
+		if (pass == BUCKET_PASS_COUNT) {
+			for (int x = 0; x + 1 < width; x++) offsets[w_e[x]]++;
+			if (!last) {
+				for (int x = 1; x < width; x++) offsets[w_sw[x]]++;
+				for (int x = 0; x < width; x++) offsets[w_s[x]]++;
+				for (int x = 0; x + 1 < width; x++) offsets[w_se[x]]++;
+			}
+		}
+		else {
+			// Same per-pixel order as build_compact_edges, so buckets keep scan order.
+			for (int x = 0; x < width; x++) {
+				uint32_t src = (uint32_t)((size_t)y * width + x) << 2;
+
+				if (x + 1 < width) codes[offsets[w_e[x]]++] = src | EDGE_DIR_E;
+				if (last) continue;
+				if (x > 0) codes[offsets[w_sw[x]]++] = src | EDGE_DIR_SW;
+				codes[offsets[w_s[x]]++] = src | EDGE_DIR_S;
+				if (x + 1 < width) codes[offsets[w_se[x]]++] = src | EDGE_DIR_SE;
+			}
+		}
+
+		Pixel* tmp = row;
+		row = next;
+		next = tmp;
+	}
+
+	free(row);
+	free(next);
+	free(weights);
+	gaussian_blur_free(&gb);
+}
+
+// compact_edge_target for a bare code; the bucket array can hold more edges than an int counts.
+static inline int bucket_edge_target(uint32_t code, int width) {
+	int src = (int)(code >> 2);
+	switch (code & 3) {
+	case EDGE_DIR_E: return src + 1;
+	case EDGE_DIR_SW: return src + width - 1;
+	case EDGE_DIR_S: return src + width;
+	default: return src + width + 1;
+	}
+}
+
+int graph_based_segmentation_buckets(DisjointSet* ds, const Image* img, float k, float sigma, int min_size) {
+	int width = img->width;
+	int height = img->height;
+	size_t pixel_count = (size_t)width * height;
+
+	ds_init(ds, (int)pixel_count);
+	if (pixel_count == 0) return 0;
+
+	// One bucket per quantized weight up to the largest RGB distance.
+	int bucket_count = gbs_quantize_weight(GBS_MAX_WEIGHT_RGB) + 1;
+	size_t* offsets = calloc((size_t)bucket_count + 1, sizeof(size_t));
+	if (offsets == NULL) {
+		fprintf(stderr, "calloc failed in graph_based_segmentation_buckets\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// 1. Count, then turn the counts into bucket starts (offsets[w + 1] is the start of w + 1).
+	stream_bucket_edges(img, sigma, BUCKET_PASS_COUNT, offsets + 1, NULL);
+	for (int w = 0; w < bucket_count; w++) offsets[w + 1] += offsets[w];
+	size_t edge_count = offsets[bucket_count];
+
+	uint32_t* codes = malloc(sizeof(uint32_t) * (edge_count > 0 ? edge_count : 1));
+	if (codes == NULL) {
+		fprintf(stderr, "malloc failed in graph_based_segmentation_buckets for %zu edges\n", edge_count);
+		exit(EXIT_FAILURE);
+	}
+
+	// 2. Scatter. Afterwards offsets[w] is the end of bucket w, which is the start of w + 1.
+	stream_bucket_edges(img, sigma, BUCKET_PASS_SCATTER, offsets, codes);
+
+	// 3. Consume the buckets in weight order; bucket w spans [offsets[w - 1], offsets[w]).
+	size_t begin = 0;
+	for (int w = 0; w < bucket_count; w++) {
+		float weight = w * (1.0f / GBS_WEIGHT_SCALE);
+		for (size_t i = begin; i < offsets[w]; i++) {
+			gbs_try_merge(ds, (int)(codes[i] >> 2), bucket_edge_target(codes[i], width), weight, k);
+		}
+		begin = offsets[w];
+	}
+
+	int merged = 0;
+	if (min_size > 1) {
+		begin = 0;
+		for (int w = 0; w < bucket_count; w++) {
+			float weight = w * (1.0f / GBS_WEIGHT_SCALE);
+			for (size_t i = begin; i < offsets[w]; i++) {
+				merged += gbs_try_join_small(ds, (int)(codes[i] >> 2), bucket_edge_target(codes[i], width), weight, min_size);
+			}
+			begin = offsets[w];
+		}
+	}
+
+	free(codes);
+	free(offsets);
+	return merged;
+}
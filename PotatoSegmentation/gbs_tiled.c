@@ -0,0 +1,300 @@
+#include "image.h"
+#include "gaussian_blur.h"
+#include "gbs.h"
+#include "disjoint_set.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+/*
+Tiled graph based segmentation.
+1. Every tile is blurred with a halo, so tile borders see real neighbours, into one shared
+   blurred image.
+2. Every tile builds and sorts the forward edges of its own pixels, seam edges included,
+   keeping the global edge codes.
+3. The sorted tile lists are merged by (weight, code), which is the order the stable sort of
+   graph_based_segmentation produces, and the k / size rule and the min_size pass run over
+   that single order.
+Steps 1 and 2 run in parallel. Because the merge sees exactly the serial edge order, the
+result equals graph_based_segmentation for every tile size.
+*/
+
+typedef struct {
+	int x0, y0, x1, y1;	// tile interior, [x0, x1) x [y0, y1)
+} Tile;
+
+static Tile tile_at(int t, int tiles_x, int tile_size, int width, int height) {
+	Tile tile;
+	tile.x0 = (t % tiles_x) * tile_size;
+	tile.y0 = (t / tiles_x) * tile_size;
+	tile.x1 = tile.x0 + tile_size > width ? width : tile.x0 + tile_size;
+	tile.y1 = tile.y0 + tile_size > height ? height : tile.y0 + tile_size;
+	return tile;
+}
+
+static void* tiled_alloc(size_t bytes) {
+	void* p = malloc(bytes > 0 ? bytes : 1);
+	if (p == NULL) {
+		fprintf(stderr, "malloc failed in graph_based_segmentation_tiled for %zu bytes\n", bytes);
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+// Blurs the tile together with a halo of radius pixels and writes its interior into blurred.
+static void blur_tile(const Image* img, Pixel* blurred, Tile t, float sigma) {
+	int width = img->width;
+	int height = img->height;
+	int radius = GBS_BLUR_KERNEL_SIZE / 2;
+
+	int hx0 = t.x0 - radius < 0 ? 0 : t.x0 - radius;
+	int hy0 = t.y0 - radius < 0 ? 0 : t.y0 - radius;
+	int hx1 = t.x1 + radius > width ? width : t.x1 + radius;
+	int hy1 = t.y1 + radius > height ? height : t.y1 + radius;
+
+	Image halo;
+	halo.width = hx1 - hx0;
+	halo.height = hy1 - hy0;
+	halo.channels = img->channels;
+	halo.pixels = tiled_alloc(sizeof(Pixel) * halo.width * halo.height);
+
+	for (int y = hy0; y < hy1; y++) {
+		memcpy(&halo.pixels[(y - hy0) * halo.width], &img->pixels[y * width + hx0], sizeof(Pixel) * halo.width);
+	}
+
+	gaussian_blur(&halo, sigma, GBS_BLUR_KERNEL_SIZE);
+
+	for (int y = t.y0; y < t.y1; y++) {
+		memcpy(&blurred[y * width + t.x0], &halo.pixels[(y - hy0) * halo.width + (t.x0 - hx0)], sizeof(Pixel) * (t.x1 - t.x0));
+	}
+	free_image(&halo);
+}
+
+/*
+Forward edges whose source pixel lies in the tile, in scan order (increasing code), then
+sorted by weight. Targets across the tile's right and bottom seams read the neighbouring
+tiles' pixels in blurred, which step 1 has finished.
+*/
+static void build_tile_edges(const Pixel* blurred, int width, int height, Tile t, CompactEdgeList* edges) {
+	int span = t.x1 - t.x0;
+	init_compact_edges(edges, width, 4 * span * (t.y1 - t.y0));
+
+	// One run per direction, indexed by x - x0.
+	uint16_t* w_e = tiled_alloc(sizeof(uint16_t) * 4 * span);
+	uint16_t* w_sw = w_e + span;
+	uint16_t* w_s = w_e + 2 * span;
+	uint16_t* w_se = w_e + 3 * span;
+
+	int e_end = t.x1 < width ? t.x1 : width - 1;  // last source with an E / SE edge, exclusive
+	int sw_begin = t.x0 > 0 ? t.x0 : 1;
+
+	for (int y = t.y0; y < t.y1; y++) {
+		const Pixel* row = &blurred[y * width];
+		const Pixel* next = (y + 1 < height) ? row + width : NULL;
+
+		edge_weight_row(row + t.x0, row + t.x0 + 1, e_end - t.x0, w_e);
+		if (next != NULL) {
+			edge_weight_row(row + sw_begin, next + sw_begin - 1, t.x1 - sw_begin, w_sw + (sw_begin - t.x0));
+			edge_weight_row(row + t.x0, next + t.x0, span, w_s);
+			edge_weight_row(row + t.x0, next + t.x0 + 1, e_end - t.x0, w_se);
+		}
+
+		for (int x = t.x0; x < t.x1; x++) {
+			int i = x - t.x0;
+			uint32_t src = (uint32_t)(y * width + x) << 2;
+			uint32_t* code = edges->code + edges->size;
+			uint16_t* weight = edges->weight + edges->size;
+			int n = 0;
+
+			if (x < e_end) { code[n] = src | EDGE_DIR_E; weight[n++] = w_e[i]; }
+			if (next != NULL) {
+				if (x > 0) { code[n] = src | EDGE_DIR_SW; weight[n++] = w_sw[i]; }
+				code[n] = src | EDGE_DIR_S; weight[n++] = w_s[i];
+				if (x < e_end) { code[n] = src | EDGE_DIR_SE; weight[n++] = w_se[i]; }
+			}
+			edges->size += n;
+		}
+	}
+
+	free(w_e);
+	sort_compact_edges(edges);
+}
+
+// Position of the next edge of one tile list in the merge heap.
+typedef struct {
+	uint16_t weight;
+	uint32_t code;
+	int tile;
+	int next;
+} TileCursor;
+
+static int cursor_before(const TileCursor* a, const TileCursor* b) {
+	if (a->weight != b->weight) return a->weight < b->weight;
+	return a->code < b->code;
+}
+
+static void cursor_sift_down(TileCursor* heap, int n, int i) {
+	TileCursor e = heap[i];
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= n) break;
+		if (child + 1 < n && cursor_before(&heap[child + 1], &heap[child])) child++;
+		if (!cursor_before(&heap[child], &e)) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = e;
+}
+
+// Merges the sorted tile lists into out by (weight, code).
+static void merge_tile_edges(CompactEdgeList* tiles, int tile_count, CompactEdgeList* out) {
+	TileCursor* heap = tiled_alloc(sizeof(TileCursor) * tile_count);
+	int n = 0;
+	for (int t = 0; t < tile_count; t++) {
+		if (tiles[t].size == 0) continue;
+		heap[n].weight = tiles[t].weight[0];
+		heap[n].code = tiles[t].code[0];
+		heap[n].tile = t;
+		heap[n].next = 1;
+		n++;
+	}
+	for (int i = n / 2 - 1; i >= 0; i--) cursor_sift_down(heap, n, i);
+
+	while (n > 0) {
+		TileCursor* top = &heap[0];
+		out->code[out->size] = top->code;
+		out->weight[out->size] = top->weight;
+		out->size++;
+
+		const CompactEdgeList* list = &tiles[top->tile];
+		if (top->next < list->size) {
+			top->weight = list->weight[top->next];
+			top->code = list->code[top->next];
+			top->next++;
+		}
+		else {
+			heap[0] = heap[--n];
+		}
+		if (n > 0) cursor_sift_down(heap, n, 0);
+	}
+	free(heap);
+}
+
+int graph_based_segmentation_tiled(DisjointSet* ds, const Image* img, float k, float sigma, int min_size, int tile_size) {
+	int width = img->width;
+	int height = img->height;
+	int pixel_count = width * height;
+
+	if (tile_size <= 0) tile_size = GBS_TILE_SIZE;
+	if (tile_size < 2) tile_size = 2;
+
+	int tiles_x = (width + tile_size - 1) / tile_size;
+	int tiles_y = (height + tile_size - 1) / tile_size;
+	int tile_count = tiles_x * tiles_y;
+
+	Pixel* blurred = tiled_alloc(sizeof(Pixel) * pixel_count);
+	CompactEdgeList* tile_edges = tiled_alloc(sizeof(CompactEdgeList) * tile_count);
+
+	// 1. Blur every tile; the edges of step 2 read across tile seams, so all tiles finish first.
+	#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < tile_count; t++) {
+		blur_tile(img, blurred, tile_at(t, tiles_x, tile_size, width, height), sigma);
+	}
+
+	// 2. Build and sort the edges of every tile.
+	#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < tile_count; t++) {
+		build_tile_edges(blurred, width, height, tile_at(t, tiles_x, tile_size, width, height), &tile_edges[t]);
+	}
+	free(blurred);
+
+	// 3. One weight-ordered pass over all edges, seams interleaved with the tile interiors.
+	CompactEdgeList edges;
+	init_compact_edges(&edges, width, compact_edge_count(width, height));
+	merge_tile_edges(tile_edges, tile_count, &edges);
+	for (int t = 0; t < tile_count; t++) free_compact_edges(&tile_edges[t]);
+	free(tile_edges);
+
+	ds_init(ds, pixel_count);
+	merge_components_compact(&edges, ds, k);
+	int merged = enforce_min_region_size(&edges, ds, min_size);
+
+	free_compact_edges(&edges);
+	return merged;
+}
+
+static int compare_label_pair(const void* a, const void* b) {
+	uint64_t pa = *(const uint64_t*)a;
+	uint64_t pb = *(const uint64_t*)b;
+	return (pa > pb) - (pa < pb);
+}
+
+// Pixels outside the largest overlap of each "from" label with a "to" label.
+static int one_sided_drift(const int* from, const int* to, int n, uint64_t* pairs) {
+	for (int i = 0; i < n; i++) {
+		pairs[i] = ((uint64_t)(uint32_t)from[i] << 32) | (uint32_t)to[i];
+	}
+	qsort(pairs, n, sizeof(uint64_t), compare_label_pair);
+
+	int matched = 0;
+	int i = 0;
+	while (i < n) {
+		uint32_t label = (uint32_t)(pairs[i] >> 32);
+		int best = 0;
+		while (i < n && (uint32_t)(pairs[i] >> 32) == label) {
+			int run = 1;
+			while (i + run < n && pairs[i + run] == pairs[i]) run++;
+			if (run > best) best = run;
+			i += run;
+		}
+		matched += best;
+	}
+	return n - matched;
+}
+
+int gbs_label_array_drift(const int* reference, const int* other, int n) {
+	/*
+	Number of pixels whose label differs between two segmentations.
+	Every component is matched to the component it overlaps most in the other
+	segmentation; pixels outside that overlap differ. Splits are counted from the
+	reference side and merges from the other side, and the larger count is returned.
+	*/
+
+	uint64_t* pairs = malloc(sizeof(uint64_t) * (n > 0 ? n : 1));
+	if (pairs == NULL) {
+		fprintf(stderr, "malloc failed in gbs_label_array_drift\n");
+		return -1;
+	}
+
+	int split = one_sided_drift(reference, other, n, pairs);
+	int merged = one_sided_drift(other, reference, n, pairs);
+
+	free(pairs);
+	return split > merged ? split : merged;
+}
+
+int gbs_label_drift(DisjointSet* reference, DisjointSet* other) {
+	assert(reference->count == other->count);
+
+	int n = reference->count;
+	int* reference_labels = malloc(sizeof(int) * (n > 0 ? n : 1));
+	int* other_labels = malloc(sizeof(int) * (n > 0 ? n : 1));
+	if (reference_labels == NULL || other_labels == NULL) {
+		fprintf(stderr, "malloc failed in gbs_label_drift\n");
+		free(reference_labels);
+		free(other_labels);
+		return -1;
+	}
+
+	ds_flatten(reference, reference_labels);
+	ds_flatten(other, other_labels);
+
+	int drift = gbs_label_array_drift(reference_labels, other_labels, n);
+
+	free(reference_labels);
+	free(other_labels);
+	return drift;
+}
@@ -1,8 +1,11 @@
 #define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "image.h"
 #include "stb_image.h"
+#include "stb_image_resize.h"
 #include <stdio.h>
 #include <string.h> 
+#include <math.h>
 
 Image copy_image(Image* src) {
     Image dst;
@@ -29,7 +32,7 @@ void set_pixel(Image* img, int x, int y, Pixel p) {
     img->pixels[y * img->width + x] = p;
 }
 
-static int _load_image_raw(RawImage* img, const char* FilePath) {
+int _load_image_raw(RawImage* img, const char* FilePath) {
     /* Load Image as (r g b r g b ...) */
 
     img->pixels = stbi_load(FilePath, &img->width, &img->height, &img->channels, 0);
@@ -44,39 +47,103 @@ static int _load_image_raw(RawImage* img, const char* FilePath) {
 }
 
 int load_image(Image* img, const char* FilePath) {
-    /* Load Image */
+    /* Load Image, decoded straight into the Pixel layout (no copy) */
 
-    RawImage raw;
-    int ImageSize;
+    int width, height, file_channels;
 
-    _load_image_raw(&raw, FilePath); // (r g b r g b ...)
-    
-    ImageSize = raw.width * raw.height;
+    // Ask stb_image for 3 channels so the buffer is (r g b r g b ...) whatever the file has.
+    unsigned char* data = stbi_load(FilePath, &width, &height, &file_channels, 3);
 
-    img->width = raw.width;
-    img->height = raw.height;
-    img->channels = raw.channels;
-    img->pixels = (Pixel*) malloc(sizeof(Pixel) * ImageSize);
+    if (data == NULL) {
+        printf("'%s' Failed To Load Image!\n", FilePath);
+        return 0;
+    }
 
-    if (img->pixels == NULL) {
-        // Handle memory allocation failure
-        free(raw.pixels); // Free the raw pixel data to prevent leak
+    image_wrap_rgb(img, data, width, height);
+
+    return 1;
+}
+
+void image_wrap_rgb(Image* img, unsigned char* data, int width, int height) {
+    /*
+    Uses an interleaved RGB buffer as the image pixels without copying.
+    The image takes the buffer over and releases it with free_image, so data must come from
+    stbi_load or malloc.
+    */
+
+    img->width = width;
+    img->height = height;
+    img->channels = 3;
+    img->pixels = (Pixel*)data;
+}
+
+int downsample_image(Image* src, Image* dst, int max_long_side, int max_pixels) {
+    /*
+    Fits src into a long side of max_long_side and a budget of max_pixels (0 = no limit).
+    Returns 1 when dst holds a new, smaller image (release it with free_image),
+    and 0 when src already fits and dst simply borrows its pixels.
+    src is only read, so one decoded image can be downsampled for several budgets.
+    */
+
+    int long_side = src->width > src->height ? src->width : src->height;
+    double scale = 1.0;
+
+    if (max_long_side > 0 && long_side > max_long_side) {
+        scale = (double)max_long_side / long_side;
+    }
+    if (max_pixels > 0 && (double)src->width * src->height * scale * scale > max_pixels) {
+        scale = sqrt((double)max_pixels / ((double)src->width * src->height));
+    }
+
+    int width = (int)(src->width * scale);
+    int height = (int)(src->height * scale);
+    if (width < 1) width = 1;
+    if (height < 1) height = 1;
+
+    if (width >= src->width && height >= src->height) {
+        *dst = *src;
         return 0;
     }
 
-    for (int i = 0; i < ImageSize; i++) {
-        img->pixels[i].r = raw.pixels[3 * i];
-        img->pixels[i].g = raw.pixels[3 * i + 1];
-        img->pixels[i].b = raw.pixels[3 * i + 2];
+    dst->width = width;
+    dst->height = height;
+    dst->channels = 3;
+    dst->pixels = (Pixel*)malloc(sizeof(Pixel) * width * height);
+    if (dst->pixels == NULL) {
+        fprintf(stderr, "malloc failed in downsample_image\n");
+        *dst = *src;
+        return 0;
     }
 
-    free(raw.pixels);
+    stbir_resize_uint8((const unsigned char*)src->pixels, src->width, src->height, 0,
+        (unsigned char*)dst->pixels, width, height, 0, 3);
 
     return 1;
 }
 
+PlaneView image_plane(const Image* img, int channel) {
+    PlaneView plane;
+    plane.width = img->width;
+    plane.height = img->height;
+    plane.pixel_stride = sizeof(Pixel);
+    plane.row_stride = sizeof(Pixel) * img->width;
+    plane.data = (const unsigned char*)img->pixels + channel;
+    return plane;
+}
+
+PlaneView plane_view(const unsigned char* data, int width, int height) {
+    PlaneView plane;
+    plane.width = width;
+    plane.height = height;
+    plane.pixel_stride = 1;
+    plane.row_stride = width;
+    plane.data = data;
+    return plane;
+}
+
 
 void free_image(Image* img) {
+    // stb_image allocates with the default STBI_MALLOC, so this also releases malloc'd pixels.
     if (img != NULL && img->pixels != NULL) {
         stbi_image_free(img->pixels);
         img->pixels = NULL;
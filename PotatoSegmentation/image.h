@@ -2,6 +2,7 @@
 #define __IMAGE_H_
 
 #include <stdio.h>
+#include <stddef.h>
 
 typedef struct {
 	int width;
@@ -10,12 +11,18 @@ typedef struct {
 	unsigned char* pixels;
 } RawImage;
 
+// 8-bit RGB, 3 bytes with no padding: same layout as stbi_load(..., 3).
 typedef struct {
-	int r;
-	int g;
-	int b;
+	unsigned char r;
+	unsigned char g;
+	unsigned char b;
 } Pixel;
 
+typedef char pixel_is_3_bytes[(sizeof(Pixel) == 3) ? 1 : -1];
+
+// Interleaved 8-bit RGB image, width * height Pixels.
+// An Image owns its pixels, whether load_image, copy_image, downsample_image or a conversion
+// allocated them, and is released with free_image. Views that borrow pixels are not freed.
 typedef struct {
 	int width;
 	int height;
@@ -23,6 +30,23 @@ typedef struct {
 	Pixel* pixels;
 } Image;
 
+/*
+Non-owning view of one 8-bit channel.
+value(x, y) = data[y * row_stride + x * pixel_stride], so the same view reads a channel
+of an interleaved Image (pixel_stride 3) or a planar buffer (pixel_stride 1).
+*/
+typedef struct {
+	int width;
+	int height;
+	int pixel_stride;
+	int row_stride;
+	const unsigned char* data;
+} PlaneView;
+
+static inline unsigned char plane_at(const PlaneView* plane, int x, int y) {
+	return plane->data[(size_t)y * plane->row_stride + (size_t)x * plane->pixel_stride];
+}
+
 typedef struct {
 	float h, s, v;
 } HSV;
@@ -37,6 +61,14 @@ int _load_image_raw(RawImage* img, const char* FilePath);
 
 int load_image(Image* img, const char* FilePath);
 
+void image_wrap_rgb(Image* img, unsigned char* data, int width, int height);
+
+int downsample_image(Image* src, Image* dst, int max_long_side, int max_pixels);
+
+PlaneView image_plane(const Image* img, int channel);
+
+PlaneView plane_view(const unsigned char* data, int width, int height);
+
 void free_image(Image* image);
 
 char* pixel_to_string(Pixel pixel);
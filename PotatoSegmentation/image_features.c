@@ -0,0 +1,127 @@
+#include "image_features.h"
+#include "color_convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void image_features_init(ImageFeatures* features, Image* source) {
+	memset(features, 0, sizeof(ImageFeatures));
+	features->source = source;
+
+	for (int cs = 0; cs < COLOR_SPACE_COUNT; cs++) {
+		omp_init_lock(&features->color_lock[cs]);
+		omp_init_lock(&features->gradients_lock[cs]);
+		omp_init_lock(&features->edges_lock[cs]);
+	}
+}
+
+void image_features_free(ImageFeatures* features) {
+	for (int cs = 0; cs < COLOR_SPACE_COUNT; cs++) {
+		if (features->color_ready[cs] && cs != COLOR_SPACE_RGB) free_image(&features->color[cs]);
+		if (features->gradients_ready[cs]) free_texture_gradients(&features->gradients[cs]);
+
+		for (int i = 0; i < features->edge_count[cs]; i++) {
+			free_compact_edges(&features->edges[cs][i]->edges);
+			free(features->edges[cs][i]);
+		}
+		free(features->edges[cs]);
+
+		omp_destroy_lock(&features->color_lock[cs]);
+		omp_destroy_lock(&features->gradients_lock[cs]);
+		omp_destroy_lock(&features->edges_lock[cs]);
+	}
+	memset(features, 0, sizeof(ImageFeatures));
+}
+
+const Image* image_features_color(ImageFeatures* features, ColorSpaceType cs) {
+	omp_set_lock(&features->color_lock[cs]);
+	if (!features->color_ready[cs]) {
+		switch (cs) {
+		case COLOR_SPACE_RGB:
+			features->color[cs] = *features->source;
+			break;
+		case COLOR_SPACE_LAB_L_CHANNEL:
+			color_convert_image(features->source, &features->color[cs], COLOR_CONVERT_LAB);
+			if (features->color[cs].pixels == NULL) {
+				fprintf(stderr, "Lab conversion failed in image_features_color\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			fprintf(stderr, "Unknown colorspace %d in image_features_color\n", cs);
+			exit(EXIT_FAILURE);
+		}
+		features->color_ready[cs] = 1;
+	}
+	omp_unset_lock(&features->color_lock[cs]);
+
+	return &features->color[cs];
+}
+
+const TextureGradients* image_features_gradients(ImageFeatures* features, ColorSpaceType cs) {
+	const Image* color = image_features_color(features, cs);
+
+	omp_set_lock(&features->gradients_lock[cs]);
+	if (!features->gradients_ready[cs]) {
+		compute_texture_gradients(color, &features->gradients[cs]);
+		features->gradients_ready[cs] = 1;
+	}
+	omp_unset_lock(&features->gradients_lock[cs]);
+
+	return &features->gradients[cs];
+}
+
+void image_features_expect(ImageFeatures* features, ColorSpaceType cs) {
+	features->gradient_users[cs]++;
+}
+
+const TextureGradients* image_features_shared_gradients(ImageFeatures* features, ColorSpaceType cs) {
+	if (features->gradient_users[cs] < 2) return NULL;
+	return image_features_gradients(features, cs);
+}
+
+static void build_sorted_edges(ImageFeatures* features, ColorSpaceType cs, float sigma, CompactEdgeList* edges) {
+	if (cs == COLOR_SPACE_LAB_L_CHANNEL) {
+		PlaneView l_plane = image_plane(image_features_color(features, cs), 0);
+		build_compact_edges_plane(&l_plane, edges);
+	}
+	else {
+		build_compact_edges_blurred(features->source, sigma, edges);
+	}
+	sort_compact_edges(edges);
+}
+
+const CompactEdgeList* image_features_edges(ImageFeatures* features, ColorSpaceType cs, float sigma) {
+	if (cs == COLOR_SPACE_LAB_L_CHANNEL) sigma = 0.0f;
+
+	CachedEdges* found = NULL;
+
+	omp_set_lock(&features->edges_lock[cs]);
+	for (int i = 0; i < features->edge_count[cs]; i++) {
+		if (features->edges[cs][i]->sigma == sigma) {
+			found = features->edges[cs][i];
+			break;
+		}
+	}
+
+	if (found == NULL) {
+		int count = features->edge_count[cs];
+		CachedEdges** list = (CachedEdges**)realloc(features->edges[cs], sizeof(CachedEdges*) * (count + 1));
+		found = (CachedEdges*)malloc(sizeof(CachedEdges));
+		if (list == NULL || found == NULL) {
+			fprintf(stderr, "malloc failed in image_features_edges\n");
+			exit(EXIT_FAILURE);
+		}
+
+		found->sigma = sigma;
+		build_sorted_edges(features, cs, sigma, &found->edges);
+
+		list[count] = found;
+		features->edges[cs] = list;
+		features->edge_count[cs] = count + 1;
+	}
+	omp_unset_lock(&features->edges_lock[cs]);
+
+	return &found->edges;
+}
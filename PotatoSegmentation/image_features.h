@@ -0,0 +1,63 @@
+#ifndef __IMAGE_FEATURES_H__
+#define __IMAGE_FEATURES_H__
+
+#include "image.h"
+#include "gbs.h"
+#include "texture.h"
+#include "selective_search.h"
+
+#include <omp.h>
+
+// Sorted GBS edges of one colour space at one blur sigma.
+typedef struct {
+	float sigma;
+	CompactEdgeList edges;
+} CachedEdges;
+
+/*
+Products derived from one image, computed on first use and then shared read-only.
+Strategies that differ only in k, sigma or weights borrow the same converted image,
+texture gradients and sorted edge lists instead of recomputing them.
+Each slot has its own lock, so strategies running on different threads only wait
+for a product somebody else is already computing.
+Texture gradients cost about 15 bytes per pixel, so they are only kept for a colour space
+that more than one strategy uses; otherwise region statistics compute them row by row.
+RGB edges come from the streaming blur in build_compact_edges_blurred, so no blurred image is stored.
+*/
+typedef struct ImageFeatures {
+	Image* source;  // borrowed, never modified
+
+	Image color[COLOR_SPACE_COUNT];  // RGB borrows source
+	int color_ready[COLOR_SPACE_COUNT];
+	omp_lock_t color_lock[COLOR_SPACE_COUNT];
+
+	TextureGradients gradients[COLOR_SPACE_COUNT];
+	int gradients_ready[COLOR_SPACE_COUNT];
+	int gradient_users[COLOR_SPACE_COUNT];  // strategies announced with image_features_expect
+	omp_lock_t gradients_lock[COLOR_SPACE_COUNT];
+
+	CachedEdges** edges[COLOR_SPACE_COUNT];  // stable pointers, one per sigma
+	int edge_count[COLOR_SPACE_COUNT];
+	omp_lock_t edges_lock[COLOR_SPACE_COUNT];
+} ImageFeatures;
+
+void image_features_init(ImageFeatures* features, Image* source);
+
+void image_features_free(ImageFeatures* features);
+
+// Image the region features of cs are computed from (RGB itself, or the Lab encoding).
+const Image* image_features_color(ImageFeatures* features, ColorSpaceType cs);
+
+const TextureGradients* image_features_gradients(ImageFeatures* features, ColorSpaceType cs);
+
+// Announces a strategy that will run on cs. Call for every strategy before any of them runs.
+void image_features_expect(ImageFeatures* features, ColorSpaceType cs);
+
+// The gradients of cs when more than one strategy was announced for it, NULL otherwise.
+const TextureGradients* image_features_shared_gradients(ImageFeatures* features, ColorSpaceType cs);
+
+// Sorted GBS edges. RGB edges are built from the image blurred with sigma;
+// Lab edges come from the unblurred L plane, so sigma does not apply there.
+const CompactEdgeList* image_features_edges(ImageFeatures* features, ColorSpaceType cs, float sigma);
+
+#endif // !__IMAGE_FEATURES_H__
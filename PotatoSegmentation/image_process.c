@@ -1,6 +1,7 @@
 #include "image.h"
 #include "matrix.h"
 #include "image_process.h"
+#include "color_convert.h"
 
 #include <stdio.h>
 #include <math.h>
@@ -168,7 +169,7 @@ void apply_kernel(Image* img, Matrix* kernel) {
         }
     }
 
-    free(img->pixels);
+    free_image(img);
     img->pixels = buffer;
 }
 
@@ -245,19 +246,9 @@ HSV rgb_to_hsv(Pixel p) {
     return hsv;
 }
 
+// rgb_to_hsv is the per-pixel reference; whole images go through the lookup tables.
 void convert_image_to_hsv(Image* src, Image* dst) {
-    dst->width = src->width;
-    dst->height = src->height;
-    dst->channels = src->channels;
-    dst->pixels = (Pixel*)malloc(sizeof(Pixel) * src->width * src->height);
-
-    for (int i = 0; i < src->width * src->height; i++) {
-        HSV hsv = rgb_to_hsv(src->pixels[i]);
-
-        dst->pixels[i].r = (int)(hsv.h / 360.0f * 255.0f); // H(0-360) -> 0-255
-        dst->pixels[i].g = (int)(hsv.s * 255.0f);          // S(0-1) -> 0-255
-        dst->pixels[i].b = (int)(hsv.v * 255.0f);          // V(0-1) -> 0-255
-    }
+    color_convert_image(src, dst, COLOR_CONVERT_HSV);
 }
 
 Lab rgb_to_lab(Pixel p) {
@@ -289,17 +280,7 @@ Lab rgb_to_lab(Pixel p) {
     return lab;
 }
 
+// rgb_to_lab is the per-pixel reference; whole images go through the lookup tables.
 void convert_image_to_lab(Image* src, Image* dst) {
-    dst->width = src->width;
-    dst->height = src->height;
-    dst->channels = src->channels;
-    dst->pixels = (Pixel*)malloc(sizeof(Pixel) * src->width * src->height);
-
-    for (int i = 0; i < src->width * src->height; i++) {
-        Lab lab = rgb_to_lab(src->pixels[i]);
-
-        dst->pixels[i].r = (int)(lab.l * 2.55f);      // L*(0-100) -> 0-255
-        dst->pixels[i].g = (int)(lab.a + 128.0f);    // a*(-128-127) -> 0-255
-        dst->pixels[i].b = (int)(lab.b + 128.0f);    // b*(-128-127) -> 0-255
-    }
+    color_convert_image(src, dst, COLOR_CONVERT_LAB);
 }
\ No newline at end of file
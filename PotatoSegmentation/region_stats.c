@@ -0,0 +1,197 @@
+#include "region_stats.h"
+#include "simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Statistics of the regions one band touches; slot i belongs to region[i].
+typedef struct {
+	int count;
+	int* region;
+	int* size;
+	RegionBounds* bounds;
+	int* color_counts;   // COLOR_HIST_STRIDE per slot
+	float* texture_raw;  // TEXTURE_HIST_STRIDE per slot
+} RegionStatsPartial;
+
+static void* stats_alloc(size_t bytes) {
+	void* p = malloc(bytes > 0 ? bytes : 1);
+	if (p == NULL) {
+		fprintf(stderr, "malloc failed in build_region_stats for %zu bytes\n", bytes);
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void partial_free(RegionStatsPartial* part) {
+	free(part->region);
+	free(part->size);
+	free(part->bounds);
+	free(part->color_counts);
+	free(part->texture_raw);
+}
+
+/*
+Accumulates rows [y0, y1) into part. slot_of has one entry per region, all -1 on entry and
+again on return; it maps the regions of this band to their slots while the band is scanned.
+mag and bin are 3 * width scratch for the gradients of one row when gradients is NULL.
+*/
+static void accumulate_band(const RegionList* rl, const Image* img, const TextureGradients* gradients,
+	int y0, int y1, int* slot_of, float* mag, unsigned char* bin, RegionStatsPartial* part) {
+	int width = img->width;
+	int height = img->height;
+	const int* labels = rl->pixel_to_region;
+
+	// 1. Give every region of the band a slot, in order of first appearance.
+	part->count = 0;
+	int capacity = 64;
+	part->region = stats_alloc(sizeof(int) * capacity);
+	for (size_t i = (size_t)y0 * width; i < (size_t)y1 * width; i++) {
+		int r = labels[i];
+		if (slot_of[r] >= 0) continue;
+		if (part->count == capacity) {
+			capacity *= 2;
+			part->region = realloc(part->region, sizeof(int) * capacity);
+			if (part->region == NULL) {
+				fprintf(stderr, "realloc failed in build_region_stats\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		slot_of[r] = part->count;
+		part->region[part->count++] = r;
+	}
+
+	int n = part->count;
+	part->size = calloc(n > 0 ? n : 1, sizeof(int));
+	part->bounds = stats_alloc(sizeof(RegionBounds) * n);
+	part->color_counts = calloc((size_t)(n > 0 ? n : 1) * COLOR_HIST_STRIDE, sizeof(int));
+	part->texture_raw = calloc((size_t)(n > 0 ? n : 1) * TEXTURE_HIST_STRIDE, sizeof(float));
+	if (part->size == NULL || part->color_counts == NULL || part->texture_raw == NULL) {
+		fprintf(stderr, "calloc failed in build_region_stats\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int s = 0; s < n; s++) {
+		part->bounds[s].min_x = width; part->bounds[s].max_x = 0;
+		part->bounds[s].min_y = height; part->bounds[s].max_y = 0;
+	}
+
+	// 2. One pass over the pixels: bounds, colour bins and texture bins together.
+	const unsigned char* bytes = (const unsigned char*)img->pixels;
+	int row_bytes = 3 * width;
+	for (int y = y0; y < y1; y++) {
+		const Pixel* row = &img->pixels[(size_t)y * width];
+		const int* row_labels = &labels[(size_t)y * width];
+
+		const float* row_mag;
+		const unsigned char* row_bin;
+		if (gradients != NULL) {
+			row_mag = gradients->mag + (size_t)y * row_bytes;
+			row_bin = gradients->bin + (size_t)y * row_bytes;
+		}
+		else {
+			const unsigned char* cur = bytes + (size_t)y * row_bytes;
+			const unsigned char* above = (y > 0) ? cur - row_bytes : cur;
+			const unsigned char* below = (y < height - 1) ? cur + row_bytes : cur;
+			texture_gradient_row(above, cur, below, width, mag, bin);
+			row_mag = mag;
+			row_bin = bin;
+		}
+
+		for (int x = 0; x < width; x++) {
+			int s = slot_of[row_labels[x]];
+			RegionBounds* box = &part->bounds[s];
+			if (x < box->min_x) box->min_x = x;
+			if (x > box->max_x) box->max_x = x;
+			if (y < box->min_y) box->min_y = y;
+			if (y > box->max_y) box->max_y = y;
+
+			part->size[s]++;
+
+			int* hist = &part->color_counts[(size_t)s * COLOR_HIST_STRIDE];
+			hist[row[x].r * 25 / 256]++;
+			hist[25 + row[x].g * 25 / 256]++;
+			hist[50 + row[x].b * 25 / 256]++;
+
+			float* tex = &part->texture_raw[(size_t)s * TEXTURE_HIST_STRIDE];
+			tex[row_bin[3 * x]] += row_mag[3 * x];
+			tex[8 + row_bin[3 * x + 1]] += row_mag[3 * x + 1];
+			tex[16 + row_bin[3 * x + 2]] += row_mag[3 * x + 2];
+		}
+	}
+
+	for (int s = 0; s < n; s++) slot_of[part->region[s]] = -1;
+}
+
+void build_region_stats(RegionList* rl, const Image* img, const TextureGradients* gradients) {
+	int width = img->width;
+	int height = img->height;
+	int band_count = (height + REGION_STATS_BAND_ROWS - 1) / REGION_STATS_BAND_ROWS;
+
+	RegionStatsPartial* partials = stats_alloc(sizeof(RegionStatsPartial) * (band_count > 0 ? band_count : 1));
+
+#pragma omp parallel
+	{
+		// Per-thread scratch: the region -> slot map and one row of gradients.
+		int* slot_of = stats_alloc(sizeof(int) * (rl->count > 0 ? rl->count : 1));
+		for (int i = 0; i < rl->count; i++) slot_of[i] = -1;
+		float* mag = NULL;
+		unsigned char* bin = NULL;
+		if (gradients == NULL) {
+			mag = (float*)simd_malloc(sizeof(float) * 3 * width);
+			bin = (unsigned char*)simd_malloc(3 * width);
+			if (mag == NULL || bin == NULL) {
+				fprintf(stderr, "simd_malloc failed in build_region_stats\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+#pragma omp for schedule(dynamic, 1)
+		for (int b = 0; b < band_count; b++) {
+			int y0 = b * REGION_STATS_BAND_ROWS;
+			int y1 = (y0 + REGION_STATS_BAND_ROWS < height) ? y0 + REGION_STATS_BAND_ROWS : height;
+			accumulate_band(rl, img, gradients, y0, y1, slot_of, mag, bin, &partials[b]);
+		}
+
+		free(slot_of);
+		if (gradients == NULL) {
+			simd_free(mag);
+			simd_free(bin);
+		}
+	}
+
+	// Reduce band by band, always in the same order.
+	for (int i = 0; i < rl->count; i++) {
+		rl->size[i] = 0;
+		rl->bounds[i].min_x = width; rl->bounds[i].max_x = 0;
+		rl->bounds[i].min_y = height; rl->bounds[i].max_y = 0;
+	}
+	memset(rl->color_counts, 0, sizeof(int) * COLOR_HIST_STRIDE * rl->count);
+	memset(rl->texture_raw, 0, sizeof(float) * TEXTURE_HIST_STRIDE * rl->count);
+
+	for (int b = 0; b < band_count; b++) {
+		RegionStatsPartial* part = &partials[b];
+		for (int s = 0; s < part->count; s++) {
+			int r = part->region[s];
+			rl->size[r] += part->size[s];
+
+			RegionBounds* box = &rl->bounds[r];
+			const RegionBounds* pb = &part->bounds[s];
+			if (pb->min_x < box->min_x) box->min_x = pb->min_x;
+			if (pb->max_x > box->max_x) box->max_x = pb->max_x;
+			if (pb->min_y < box->min_y) box->min_y = pb->min_y;
+			if (pb->max_y > box->max_y) box->max_y = pb->max_y;
+
+			int* hist = &rl->color_counts[(size_t)r * COLOR_HIST_STRIDE];
+			const int* part_hist = &part->color_counts[(size_t)s * COLOR_HIST_STRIDE];
+			for (int j = 0; j < 75; j++) hist[j] += part_hist[j];
+
+			float* tex = &rl->texture_raw[(size_t)r * TEXTURE_HIST_STRIDE];
+			const float* part_tex = &part->texture_raw[(size_t)s * TEXTURE_HIST_STRIDE];
+			for (int j = 0; j < 24; j++) tex[j] += part_tex[j];
+		}
+		partial_free(part);
+	}
+
+	free(partials);
+}
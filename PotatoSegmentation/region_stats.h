@@ -0,0 +1,22 @@
+#ifndef __REGION_STATS_H__
+#define __REGION_STATS_H__
+
+#include "image.h"
+#include "texture.h"
+#include "selective_search.h"
+
+// Rows per band of build_region_stats. Fixed, so the float sums do not depend on the thread count.
+#define REGION_STATS_BAND_ROWS 32
+
+/*
+Fills size, bounds, color_counts and texture_raw of every region in rl from img,
+with rl->pixel_to_region, rl->count and the arrays already set up by rl_reserve.
+Bands of REGION_STATS_BAND_ROWS rows are accumulated in parallel into partial tables
+that only hold the regions the band touches, and the partials are added up band by band.
+Integer statistics equal a serial scan exactly; the texture sums are added in band order,
+so they are the same for every thread count.
+gradients may be NULL, in which case they are computed per row inside the bands.
+*/
+void build_region_stats(RegionList* rl, const Image* img, const TextureGradients* gradients);
+
+#endif // !__REGION_STATS_H__
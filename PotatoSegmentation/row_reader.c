@@ -0,0 +1,130 @@
+// fseeko and a 64-bit off_t on POSIX; these must come before any system header.
+#ifndef _MSC_VER
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "row_reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+static int image_read_row(RowReader* reader, int y, Pixel* out) {
+	const Image* img = (const Image*)reader->ctx;
+	memcpy(out, &img->pixels[(size_t)y * img->width], sizeof(Pixel) * img->width);
+	return 1;
+}
+
+void row_reader_from_image(RowReader* reader, const Image* img) {
+	reader->width = img->width;
+	reader->height = img->height;
+	reader->read_row = image_read_row;
+	reader->close = NULL;
+	reader->ctx = (void*)img;
+}
+
+typedef struct {
+	FILE* file;
+	int64_t data_offset;
+	int row_padded;
+	int top_down;
+	unsigned char* row;
+} BmpReader;
+
+static uint32_t read_le32(const unsigned char* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t read_le16(const unsigned char* p) {
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// fseek takes a long, which is 32 bits on MSVC; files this reader exists for can be larger.
+static int seek64(FILE* file, int64_t offset) {
+#ifdef _MSC_VER
+	return _fseeki64(file, offset, SEEK_SET);
+#else
+	return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static int bmp_read_row(RowReader* reader, int y, Pixel* out) {
+	BmpReader* bmp = (BmpReader*)reader->ctx;
+
+	// Bottom-up files store the last row first, so every row is one seek away.
+	int file_row = bmp->top_down ? y : reader->height - 1 - y;
+	int64_t offset = bmp->data_offset + (int64_t)file_row * bmp->row_padded;
+	if (seek64(bmp->file, offset) != 0) return 0;
+	if (fread(bmp->row, 1, bmp->row_padded, bmp->file) != (size_t)bmp->row_padded) return 0;
+
+	for (int x = 0; x < reader->width; x++) {
+		out[x].b = bmp->row[3 * x];
+		out[x].g = bmp->row[3 * x + 1];
+		out[x].r = bmp->row[3 * x + 2];
+	}
+	return 1;
+}
+
+static void bmp_close(RowReader* reader) {
+	BmpReader* bmp = (BmpReader*)reader->ctx;
+	fclose(bmp->file);
+	free(bmp->row);
+	free(bmp);
+	reader->ctx = NULL;
+}
+
+int row_reader_open_bmp(RowReader* reader, const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return 0;
+	}
+
+	// BITMAPFILEHEADER (14 bytes) followed by the start of BITMAPINFOHEADER.
+	unsigned char header[54];
+	if (fread(header, 1, sizeof(header), file) != sizeof(header) || header[0] != 'B' || header[1] != 'M') {
+		fprintf(stderr, "%s is not a BMP file\n", path);
+		fclose(file);
+		return 0;
+	}
+
+	int width = (int)read_le32(header + 18);
+	int height = (int)read_le32(header + 22);
+	uint16_t bit_count = read_le16(header + 28);
+	uint32_t compression = read_le32(header + 30);
+	if (bit_count != 24 || compression != 0 || width <= 0 || height == 0) {
+		fprintf(stderr, "%s: only uncompressed 24-bit BMP is supported\n", path);
+		fclose(file);
+		return 0;
+	}
+
+	BmpReader* bmp = malloc(sizeof(BmpReader));
+	if (bmp == NULL) {
+		fprintf(stderr, "malloc failed in row_reader_open_bmp\n");
+		exit(EXIT_FAILURE);
+	}
+	bmp->file = file;
+	bmp->data_offset = (int64_t)read_le32(header + 10);
+	bmp->row_padded = (width * 3 + 3) & (~3);
+	bmp->top_down = height < 0;
+	bmp->row = malloc(bmp->row_padded);
+	if (bmp->row == NULL) {
+		fprintf(stderr, "malloc failed in row_reader_open_bmp\n");
+		exit(EXIT_FAILURE);
+	}
+
+	reader->width = width;
+	reader->height = height < 0 ? -height : height;
+	reader->read_row = bmp_read_row;
+	reader->close = bmp_close;
+	reader->ctx = bmp;
+	return 1;
+}
+
+void row_reader_close(RowReader* reader) {
+	if (reader->close != NULL) reader->close(reader);
+	reader->close = NULL;
+	reader->read_row = NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef __ROW_READER_H__
+#define __ROW_READER_H__
+
+#include "image.h"
+
+/*
+Sequential source of RGB rows, for images that are processed without being fully loaded.
+Rows are read in increasing y order, each at most once.
+*/
+typedef struct RowReader {
+	int width;
+	int height;
+	// Copies row y into out (width Pixels). Returns 1 on success, 0 on a read error.
+	int (*read_row)(struct RowReader* reader, int y, Pixel* out);
+	void (*close)(struct RowReader* reader);
+	void* ctx;
+} RowReader;
+
+// Reads the rows of an image that is already in memory; nothing is copied up front.
+void row_reader_from_image(RowReader* reader, const Image* img);
+
+// Streams an uncompressed 24-bit BMP (top-down or bottom-up), as save_bmp writes them.
+// Returns 1 on success; only one row is buffered at a time.
+int row_reader_open_bmp(RowReader* reader, const char* path);
+
+void row_reader_close(RowReader* reader);
+
+#endif // !__ROW_READER_H__
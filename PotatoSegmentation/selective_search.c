@@ -4,25 +4,18 @@
 #include "utils.h"
 #include "gbs.h"
 #include "image_process.h"
+#include "texture.h"
+#include "simd.h"
+#include "similarity_kernels.h"
+#include "color_convert.h"
+#include "image_features.h"
+#include "region_stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
-#endif
-
-typedef struct { float mag; float ori; } GradientPixel;
-static GradientPixel* calculate_gradients(Image* img, int channel);
-
-static inline unsigned char get_pixel_channel(Pixel* p, int channel) {
-	if (channel == 0) return p->r;
-	if (channel == 1) return p->g;
-	return p->b;
-}
-
 void sl_free(SimilarityList* sl) {
 	if (sl && sl->similarities) {
 		free(sl->similarities);
@@ -30,68 +23,91 @@ void sl_free(SimilarityList* sl) {
 	}
 }
 
-float color_similarity(Region* region1, Region* region2) {
-	float similarity = 0.0f;
-	for (int k = 0; k < 75; k++) {
-		similarity += fminf(region1->color_hist[k], region2->color_hist[k]);
-	}
-	return similarity;
+// The normalized histograms are derived inside the kernels, see similarity_kernels.h.
+float color_similarity(const RegionList* rl, int idx1, int idx2) {
+	return histogram_kernels()->color(
+		rl->color_counts + (size_t)idx1 * COLOR_HIST_STRIDE,
+		rl->color_counts + (size_t)idx2 * COLOR_HIST_STRIDE,
+		(float)rl->size[idx1], (float)rl->size[idx2]);
 }
 
-float texture_similarity(Region* region1, Region* region2) {
-	float similarity = 0.0f;
-	for (int k = 0; k < 24; k++) {
-		similarity += fminf(region1->texture_hist[k], region2->texture_hist[k]);
-	}
-	return similarity;
+float texture_similarity(const RegionList* rl, int idx1, int idx2) {
+	return histogram_kernels()->texture(
+		rl->texture_raw + (size_t)idx1 * TEXTURE_HIST_STRIDE,
+		rl->texture_raw + (size_t)idx2 * TEXTURE_HIST_STRIDE,
+		rl->texture_total + (size_t)idx1 * 4,
+		rl->texture_total + (size_t)idx2 * 4);
 }
 
-float size_similarity(Region* region1, Region* region2, int img_size) {
-	return 1.0f - (float)(region1->size + region2->size) / (float)img_size;
+float size_similarity(const RegionList* rl, int idx1, int idx2) {
+	return 1.0f - (float)(rl->size[idx1] + rl->size[idx2]) / (float)rl->img_size;
 }
 
-float fill_similarity(Region* region1, Region* region2, int img_size) {
-	int x_min = min(region1->min_x, region2->min_x);
-	int y_min = min(region1->min_y, region2->min_y);
-	int x_max = max(region1->max_x, region2->max_x);
-	int y_max = max(region1->max_y, region2->max_y);
+float fill_similarity(const RegionList* rl, int idx1, int idx2) {
+	RegionBounds box = rl_merged_bounds(rl, idx1, idx2);
 
-	int bbox_area = (x_max - x_min + 1) * (y_max - y_min + 1);
-	int total_area = region1->size + region2->size;
+	int bbox_area = (box.max_x - box.min_x + 1) * (box.max_y - box.min_y + 1);
+	int total_area = rl->size[idx1] + rl->size[idx2];
 
-	return 1.0f - (float)(bbox_area - total_area) / (float)img_size;
+	return 1.0f - (float)(bbox_area - total_area) / (float)rl->img_size;
 }
 
 
-void add_similarity(RegionList* rl, SimilarityList* sl, int idx1, int idx2) {
-	if (sl->count >= sl->capacity) {
-		sl->capacity = (sl->capacity == 0) ? 100 : sl->capacity * 2;
-		sl->similarities = (Similarity*)realloc(sl->similarities, sizeof(Similarity) * sl->capacity);
-	}
+// All four terms for one pair in one call, with the intersection kernels looked up once.
+float combined_similarity(const RegionList* rl, int idx1, int idx2) {
+	const HistogramKernels* kernels = histogram_kernels();
+	int size1 = rl->size[idx1];
+	int size2 = rl->size[idx2];
 
-	if (idx1 > idx2) { int temp = idx1; idx1 = idx2; idx2 = temp; }
+	const float w_color = rl->weights.color;
+	const float w_texture = rl->weights.texture;
+	const float w_size = rl->weights.size;
+	const float w_fill = rl->weights.fill;
 
-	Region* region1 = &rl->regions[idx1];
-	Region* region2 = &rl->regions[idx2];
+	const float max_possible_score = (w_color * 3.0f) + (w_texture * 3.0f) + (w_size * 1.0f) + (w_fill * 1.0f);
 
-	const float w_color = W_COLOR;
-	const float w_texture = W_TEXTURE;
-	const float w_size = W_SIZE;
-	const float w_fill = W_FILL;
+	float color = kernels->color(
+		rl->color_counts + (size_t)idx1 * COLOR_HIST_STRIDE,
+		rl->color_counts + (size_t)idx2 * COLOR_HIST_STRIDE,
+		(float)size1, (float)size2);
+	float texture = kernels->texture(
+		rl->texture_raw + (size_t)idx1 * TEXTURE_HIST_STRIDE,
+		rl->texture_raw + (size_t)idx2 * TEXTURE_HIST_STRIDE,
+		rl->texture_total + (size_t)idx1 * 4,
+		rl->texture_total + (size_t)idx2 * 4);
 
-	const float max_possible_score = (w_color * 3.0f) + (w_texture * 3.0f) + (w_size * 1.0f) + (w_fill * 1.0f);
+	float size = 1.0f - (float)(size1 + size2) / (float)rl->img_size;
+
+	RegionBounds box = rl_merged_bounds(rl, idx1, idx2);
+	int bbox_area = (box.max_x - box.min_x + 1) * (box.max_y - box.min_y + 1);
+	float fill = 1.0f - (float)(bbox_area - (size1 + size2)) / (float)rl->img_size;
 
 	float raw_similarity =
-		w_color * color_similarity(region1, region2) +
-		w_texture * texture_similarity(region1, region2) +
-		w_size * size_similarity(region1, region2, rl->img_size) +
-		w_fill * fill_similarity(region1, region2, rl->img_size);
+		w_color * color +
+		w_texture * texture +
+		w_size * size +
+		w_fill * fill;
+
+	return (max_possible_score > 0) ? raw_similarity / max_possible_score : 0;
+}
+
+// Boosts similarity for smaller regions.
+static float boosted_similarity(RegionList* rl, int idx1, int idx2, float sim, float min_size_factor) {
+	int min_size = min(rl->size[idx1], rl->size[idx2]);
+	return sim + (1.0f / (1 + min_size)) * min_size_factor;
+}
+
+void add_similarity(RegionList* rl, SimilarityList* sl, int idx1, int idx2) {
+	if (sl->count >= sl->capacity) {
+		sl->capacity = (sl->capacity == 0) ? 100 : sl->capacity * 2;
+		sl->similarities = (Similarity*)realloc(sl->similarities, sizeof(Similarity) * sl->capacity);
+	}
 
-	float normalized_similarity = (max_possible_score > 0) ? raw_similarity / max_possible_score : 0;
+	if (idx1 > idx2) { int temp = idx1; idx1 = idx2; idx2 = temp; }
 
 	sl->similarities[sl->count].region_idx1 = idx1;
 	sl->similarities[sl->count].region_idx2 = idx2;
-	sl->similarities[sl->count].similarity = normalized_similarity;
+	sl->similarities[sl->count].similarity = combined_similarity(rl, idx1, idx2);
 	sl->count++;
 }
 
@@ -102,7 +118,7 @@ Similarity* get_best_similarity(SimilarityList* sl, RegionList* rl, float min_si
 	for (int i = 0; i < sl->count; i++) {
 		int i1 = sl->similarities[i].region_idx1;
 		int i2 = sl->similarities[i].region_idx2;
-		if (rl->regions[i1].size == 0 || rl->regions[i2].size == 0) continue;
+		if (rl->size[i1] == 0 || rl->size[i2] == 0) continue;
 
 		best_idx = i;
 		break;
@@ -113,13 +129,9 @@ Similarity* get_best_similarity(SimilarityList* sl, RegionList* rl, float min_si
 	for (int i = 0; i < sl->count; i++) {
 		int i1 = sl->similarities[i].region_idx1;
 		int i2 = sl->similarities[i].region_idx2;
-		if (rl->regions[i1].size == 0 || rl->regions[i2].size == 0) continue;
+		if (rl->size[i1] == 0 || rl->size[i2] == 0) continue;
 
-		float sim = sl->similarities[i].similarity;
-		int min_size = min(rl->regions[i1].size, rl->regions[i2].size);
-
-		// Boosts similarity for smaller regions.
-		float boosted_sim = sim + (1.0f / (1 + min_size)) * min_size_factor;
+		float boosted_sim = boosted_similarity(rl, i1, i2, sl->similarities[i].similarity, min_size_factor);
 
 		if (boosted_sim > best_score) {
 			best_score = boosted_sim;
@@ -130,96 +142,224 @@ Similarity* get_best_similarity(SimilarityList* sl, RegionList* rl, float min_si
 }
 
 
+// Orders entries by score, then by insertion order (earlier wins), like get_best_similarity.
+static bool sh_before(const SimilarityHeapEntry* a, const SimilarityHeapEntry* b) {
+	if (a->score != b->score) return a->score > b->score;
+	return a->seq < b->seq;
+}
+
+void sh_init(SimilarityHeap* sh, int region_count, int initial_capacity) {
+	sh->count = 0;
+	sh->capacity = initial_capacity > 0 ? initial_capacity : 1024;
+	sh->next_seq = 0;
+	sh->entries = (SimilarityHeapEntry*)malloc(sizeof(SimilarityHeapEntry) * sh->capacity);
+	sh->versions = (int*)calloc(region_count > 0 ? region_count : 1, sizeof(int));
+
+	if (sh->entries == NULL || sh->versions == NULL) {
+		fprintf(stderr, "malloc failed in sh_init\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void sh_push(SimilarityHeap* sh, RegionList* rl, int idx1, int idx2, float min_size_factor) {
+	if (sh->count >= sh->capacity) {
+		sh->capacity *= 2;
+		sh->entries = (SimilarityHeapEntry*)realloc(sh->entries, sizeof(SimilarityHeapEntry) * sh->capacity);
+		if (sh->entries == NULL) {
+			fprintf(stderr, "realloc failed in sh_push\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (idx1 > idx2) { int temp = idx1; idx1 = idx2; idx2 = temp; }
+
+	// The boost only depends on the sizes of the two regions, and any merge that changes
+	// them also invalidates this entry, so the score can be computed once here.
+	SimilarityHeapEntry e;
+	e.region_idx1 = idx1;
+	e.region_idx2 = idx2;
+	e.version1 = sh->versions[idx1];
+	e.version2 = sh->versions[idx2];
+	e.seq = sh->next_seq++;
+	e.score = boosted_similarity(rl, idx1, idx2, combined_similarity(rl, idx1, idx2), min_size_factor);
+
+	int i = sh->count++;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (!sh_before(&e, &sh->entries[parent])) break;
+		sh->entries[i] = sh->entries[parent];
+		i = parent;
+	}
+	sh->entries[i] = e;
+}
+
+static void sh_pop_top(SimilarityHeap* sh) {
+	SimilarityHeapEntry last = sh->entries[--sh->count];
+	int n = sh->count;
+	int i = 0;
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= n) break;
+		if (child + 1 < n && sh_before(&sh->entries[child + 1], &sh->entries[child])) child++;
+		if (!sh_before(&sh->entries[child], &last)) break;
+		sh->entries[i] = sh->entries[child];
+		i = child;
+	}
+	if (n > 0) sh->entries[i] = last;
+}
+
+// Pops the best live pair and its boosted similarity. Returns false once no live pair is left.
+bool sh_pop(SimilarityHeap* sh, int* idx1, int* idx2, float* score) {
+	while (sh->count > 0) {
+		SimilarityHeapEntry top = sh->entries[0];
+		sh_pop_top(sh);
+
+		if (top.version1 != sh->versions[top.region_idx1] ||
+			top.version2 != sh->versions[top.region_idx2]) continue;
+
+		*idx1 = top.region_idx1;
+		*idx2 = top.region_idx2;
+		*score = top.score;
+		return true;
+	}
+	return false;
+}
+
+// Marks every queued pair that involves region_idx as stale.
+void sh_invalidate(SimilarityHeap* sh, int region_idx) {
+	sh->versions[region_idx]++;
+}
+
+void sh_free(SimilarityHeap* sh) {
+	if (sh) {
+		free(sh->entries);
+		free(sh->versions);
+		sh->entries = NULL;
+		sh->versions = NULL;
+		sh->count = 0;
+	}
+}
 
 void init_region_list(RegionList* region_list) {
-	region_list->capacity = 100;
-	region_list->count = 0;
-	region_list->regions = (Region*)malloc(sizeof(Region) * region_list->capacity);
-	region_list->img_size = 0;
+	memset(region_list, 0, sizeof(RegionList));
+}
+
+// Allocates the per-region arrays for capacity regions, histograms zeroed.
+static void rl_reserve(RegionList* rl, int capacity) {
+	rl->capacity = capacity;
+	rl->id = (int*)malloc(sizeof(int) * capacity);
+	rl->size = (int*)calloc(capacity, sizeof(int));
+	rl->bounds = (RegionBounds*)malloc(sizeof(RegionBounds) * capacity);
+	rl->color_counts = (int*)simd_malloc(sizeof(int) * COLOR_HIST_STRIDE * capacity);
+	rl->texture_raw = (float*)simd_malloc(sizeof(float) * TEXTURE_HIST_STRIDE * capacity);
+	rl->texture_total = (float*)simd_malloc(sizeof(float) * 4 * capacity);
+
+	if (rl->id == NULL || rl->size == NULL || rl->bounds == NULL ||
+		rl->color_counts == NULL || rl->texture_raw == NULL || rl->texture_total == NULL) {
+		fprintf(stderr, "malloc failed in rl_reserve for %d regions\n", capacity);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(rl->color_counts, 0, sizeof(int) * COLOR_HIST_STRIDE * capacity);
+	memset(rl->texture_raw, 0, sizeof(float) * TEXTURE_HIST_STRIDE * capacity);
+	memset(rl->texture_total, 0, sizeof(float) * 4 * capacity);
 }
 
-int are_regions_adjacent(Region* a, Region* b) {
+int are_regions_adjacent(const RegionBounds* a, const RegionBounds* b) {
 	if (a->max_x + 1 < b->min_x || b->max_x + 1 < a->min_x) return 0;
 	if (a->max_y + 1 < b->min_y || b->max_y + 1 < a->min_y) return 0;
 	return 1;
 }
 
-RegionList create_regions(Image* img, DisjointSet* ds) {
-	int width = img->width;
-	int height = img->height;
-	int pixel_count = width * height;
-
-	RegionList rl;
-	init_region_list(&rl);
-	rl.img_size = pixel_count;
+// Returns the position of value in ns, or -(insertion point) - 1 when it is missing.
+static int ns_search(const NeighborSet* ns, int value) {
+	int lo = 0, hi = ns->count - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (ns->items[mid] < value) lo = mid + 1;
+		else if (ns->items[mid] > value) hi = mid - 1;
+		else return mid;
+	}
+	return -lo - 1;
+}
 
-	GradientPixel* grad_r = calculate_gradients(img, 0);
-	GradientPixel* grad_g = calculate_gradients(img, 1);
-	GradientPixel* grad_b = calculate_gradients(img, 2);
+static void ns_reserve(NeighborSet* ns, int capacity) {
+	if (ns->capacity >= capacity) return;
+	int new_capacity = ns->capacity == 0 ? 4 : ns->capacity * 2;
+	if (new_capacity < capacity) new_capacity = capacity;
+	ns->items = (int*)realloc(ns->items, sizeof(int) * new_capacity);
+	if (ns->items == NULL) {
+		fprintf(stderr, "realloc failed in ns_reserve\n");
+		exit(EXIT_FAILURE);
+	}
+	ns->capacity = new_capacity;
+}
 
-	int map_size = ds->count;
-	int* parent_to_idx_map = malloc(sizeof(int) * map_size);
-	for (int i = 0; i < map_size; i++) parent_to_idx_map[i] = -1;
+static void ns_insert(NeighborSet* ns, int value) {
+	int pos = ns_search(ns, value);
+	if (pos >= 0) return;
+	pos = -pos - 1;
 
-	int region_count_final = 0;
-	for (int i = 0; i < pixel_count; i++) {
-		int parent = ds_find(ds, i);
-		if (parent_to_idx_map[parent] == -1) {
-			parent_to_idx_map[parent] = region_count_final++;
-		}
-	}
+	ns_reserve(ns, ns->count + 1);
+	memmove(&ns->items[pos + 1], &ns->items[pos], sizeof(int) * (ns->count - pos));
+	ns->items[pos] = value;
+	ns->count++;
+}
 
-	rl.capacity = region_count_final;
-	rl.count = region_count_final;
-	rl.regions = realloc(rl.regions, sizeof(Region) * rl.capacity);
+static void ns_remove(NeighborSet* ns, int value) {
+	int pos = ns_search(ns, value);
+	if (pos < 0) return;
 
-	rl.pixel_to_region = malloc(sizeof(int) * pixel_count);
+	memmove(&ns->items[pos], &ns->items[pos + 1], sizeof(int) * (ns->count - pos - 1));
+	ns->count--;
+}
 
-	float* raw_texture_hists = calloc(rl.capacity * 24, sizeof(float));
+bool rl_are_adjacent(const RegionList* rl, int idx1, int idx2) {
+	return ns_search(&rl->neighbors[idx1], idx2) >= 0;
+}
 
-	for (int i = 0; i < rl.count; i++) {
-		Region* region = &rl.regions[i];
-		region->size = 0;
-		region->min_x = width; region->max_x = 0;
-		region->min_y = height; region->max_y = 0;
-		for (int k = 0; k < 25; k++) region->r[k] = region->g[k] = region->b[k] = 0;
-	}
+RegionList create_regions(const Image* img, DisjointSet* ds) {
+	return create_regions_with_gradients(img, ds, NULL);
+}
 
-	for (int i = 0; i < pixel_count; i++) {
-		int parent = ds_find(ds, i);
-		int idx = parent_to_idx_map[parent];
+// gradients may be NULL, in which case they are computed row by row and not kept.
+RegionList create_regions_with_gradients(const Image* img, DisjointSet* ds, const TextureGradients* gradients) {
+	int width = img->width;
+	int height = img->height;
+	int pixel_count = width * height;
 
-		rl.pixel_to_region[i] = idx;
-		Region* region = &rl.regions[idx];
-		Pixel* pixel = &img->pixels[i];
-		int x = i % width;
-		int y = i / width;
+	RegionList rl;
+	init_region_list(&rl);
+	rl.img_size = pixel_count;
 
-		if (region->size == 0) region->id = parent;
+	rl.pixel_to_region = malloc(sizeof(int) * pixel_count);
+	int region_count_final = ds_flatten(ds, rl.pixel_to_region);
 
-		region->min_x = min(region->min_x, x);
-		region->max_x = max(region->max_x, x);
-		region->min_y = min(region->min_y, y);
-		region->max_y = max(region->max_y, y);
+	rl_reserve(&rl, region_count_final);
+	rl.count = region_count_final;
+	rl.weights = default_similarity_weights();
 
-		region->size++;
+	// The region id is the root pixel of the component, used for ds_union while merging.
+	for (int i = 0; i < ds->count; i++) {
+		int idx = ds->nodes[i].region;
+		if (idx >= 0 && ds->nodes[i].parent == i) rl.id[idx] = i;
+	}
 
-		region->r[pixel->r * 25 / 256]++;
-		region->g[pixel->g * 25 / 256]++;
-		region->b[pixel->b * 25 / 256]++;
+	// Size, bounds, colour and texture histograms in one parallel pass over row bands.
+	build_region_stats(&rl, img, gradients);
 
-		int bin;
-		bin = (int)(grad_r[i].ori / (2 * M_PI) * 8.0f);
-		raw_texture_hists[idx * 24 + (bin % 8)] += grad_r[i].mag;
-		bin = (int)(grad_g[i].ori / (2 * M_PI) * 8.0f);
-		raw_texture_hists[idx * 24 + 8 + (bin % 8)] += grad_g[i].mag;
-		bin = (int)(grad_b[i].ori / (2 * M_PI) * 8.0f);
-		raw_texture_hists[idx * 24 + 16 + (bin % 8)] += grad_b[i].mag;
+	for (int i = 0; i < rl.count; i++) {
+		const float* raw = &rl.texture_raw[(size_t)i * TEXTURE_HIST_STRIDE];
+		float* total = &rl.texture_total[(size_t)i * 4];
+		for (int c = 0; c < 3; c++) {
+			for (int j = 0; j < 8; j++) total[c] += raw[c * 8 + j];
+		}
 	}
 
-	rl.adjacent = malloc(sizeof(bool*) * rl.count);
-	for (int r = 0; r < rl.count; r++) {
-		rl.adjacent[r] = calloc(rl.count, sizeof(bool));
+	rl.neighbors = calloc(rl.count, sizeof(NeighborSet));
+	if (rl.neighbors == NULL) {
+		fprintf(stderr, "calloc failed in create_regions\n");
+		exit(EXIT_FAILURE);
 	}
 
 	for (int y = 0; y < height - 1; y++) {
@@ -227,141 +367,126 @@ RegionList create_regions(Image* img, DisjointSet* ds) {
 			int r1_idx = rl.pixel_to_region[y * width + x];
 			int r2_idx = rl.pixel_to_region[y * width + x + 1];
 			int r3_idx = rl.pixel_to_region[(y + 1) * width + x];
-			if (r1_idx != r2_idx) rl.adjacent[r1_idx][r2_idx] = rl.adjacent[r2_idx][r1_idx] = true;
-			if (r1_idx != r3_idx) rl.adjacent[r1_idx][r3_idx] = rl.adjacent[r3_idx][r1_idx] = true;
-		}
-	}
-
-	for (int i = 0; i < rl.count; i++) {
-		Region* region = &rl.regions[i];
-		if (region->size == 0) continue;
-
-		for (int j = 0; j < 25; j++) {
-			region->color_hist[j] = (float)region->r[j] / region->size;
-			region->color_hist[j + 25] = (float)region->g[j] / region->size;
-			region->color_hist[j + 50] = (float)region->b[j] / region->size;
-		}
-
-		float* raw_hist_ptr = &raw_texture_hists[i * 24];
-
-		for (int k = 0; k < 24; k++) {
-			region->raw_texture_hist[k] = raw_hist_ptr[k];
+			if (r1_idx != r2_idx) {
+				ns_insert(&rl.neighbors[r1_idx], r2_idx);
+				ns_insert(&rl.neighbors[r2_idx], r1_idx);
+			}
+			if (r1_idx != r3_idx) {
+				ns_insert(&rl.neighbors[r1_idx], r3_idx);
+				ns_insert(&rl.neighbors[r3_idx], r1_idx);
+			}
 		}
-
-		float total_mag_r = 0, total_mag_g = 0, total_mag_b = 0;
-		for (int j = 0; j < 8; j++) total_mag_r += raw_hist_ptr[j];
-		for (int j = 0; j < 8; j++) total_mag_g += raw_hist_ptr[j + 8];
-		for (int j = 0; j < 8; j++) total_mag_b += raw_hist_ptr[j + 16];
-
-		if (total_mag_r > 0) for (int j = 0; j < 8; j++) region->texture_hist[j] = raw_hist_ptr[j] / total_mag_r;
-		else for (int j = 0; j < 8; j++) region->texture_hist[j] = 0;
-		if (total_mag_g > 0) for (int j = 0; j < 8; j++) region->texture_hist[j + 8] = raw_hist_ptr[j + 8] / total_mag_g;
-		else for (int j = 0; j < 8; j++) region->texture_hist[j + 8] = 0;
-		if (total_mag_b > 0) for (int j = 0; j < 8; j++) region->texture_hist[j + 16] = raw_hist_ptr[j + 16] / total_mag_b;
-		else for (int j = 0; j < 8; j++) region->texture_hist[j + 16] = 0;
 	}
 
-	free(raw_texture_hists);
-	free(parent_to_idx_map);
-	free(grad_r);
-	free(grad_g);
-	free(grad_b);
 	return rl;
 }
 
 void calculate_similarity(RegionList* rl, SimilarityList* sl) {
 	for (int i = 0; i < rl->count; i++) {
 		// Skips inactive regions (optimization).
-		if (rl->regions[i].size == 0) continue;
-
-		for (int j = i + 1; j < rl->count; j++) {
-			if (rl->regions[j].size == 0) continue;
+		if (rl->size[i] == 0) continue;
 
-			// Calculates similarity only for adjacent regions.
-			if (rl->adjacent[i][j]) {
-				add_similarity(rl, sl, i, j);
-			}
+		// Calculates similarity only for adjacent regions, each pair once.
+		NeighborSet* ns = &rl->neighbors[i];
+		for (int n = 0; n < ns->count; n++) {
+			int j = ns->items[n];
+			if (j > i) add_similarity(rl, sl, i, j);
 		}
 	}
 }
 
 void rl_free(RegionList* rl) {
 	if (rl) {
-		free(rl->regions);
+		free(rl->id);
+		free(rl->size);
+		free(rl->bounds);
+		simd_free(rl->color_counts);
+		simd_free(rl->texture_raw);
+		simd_free(rl->texture_total);
 		free(rl->pixel_to_region);
-		if (rl->adjacent) {
-			for (int i = 0; i < rl->capacity; i++) {
-				free(rl->adjacent[i]);
+		if (rl->neighbors) {
+			for (int i = 0; i < rl->count; i++) {
+				free(rl->neighbors[i].items);
 			}
-			free(rl->adjacent);
+			free(rl->neighbors);
 		}
 	}
 }
 
-Region merge_regions(Region* r1, Region* r2) {
-	Region merged;
+RegionBounds rl_merged_bounds(const RegionList* rl, int idx1, int idx2) {
+	const RegionBounds* a = &rl->bounds[idx1];
+	const RegionBounds* b = &rl->bounds[idx2];
+	RegionBounds box;
+	box.min_x = min(a->min_x, b->min_x);
+	box.min_y = min(a->min_y, b->min_y);
+	box.max_x = max(a->max_x, b->max_x);
+	box.max_y = max(a->max_y, b->max_y);
+	return box;
+}
 
-	merged.id = min(r1->id, r2->id);
-	merged.size = r1->size + r2->size;
+int rl_merge_regions(RegionList* rl, int idx1, int idx2) {
+	if (idx1 == idx2) return -1;
+	int keep_idx = min(idx1, idx2);
+	int remove_idx = max(idx1, idx2);
 
-	merged.min_x = min(r1->min_x, r2->min_x);
-	merged.min_y = min(r1->min_y, r2->min_y);
-	merged.max_x = max(r1->max_x, r2->max_x);
-	merged.max_y = max(r1->max_y, r2->max_y);
+	// Merges the removed region's counts into the kept one in place.
+	rl->id[keep_idx] = min(rl->id[idx1], rl->id[idx2]);
+	rl->size[keep_idx] += rl->size[remove_idx];
+	rl->bounds[keep_idx] = rl_merged_bounds(rl, idx1, idx2);
 
-	for (int i = 0; i < 25; i++) {
-		merged.r[i] = r1->r[i] + r2->r[i];
-		merged.g[i] = r1->g[i] + r2->g[i];
-		merged.b[i] = r1->b[i] + r2->b[i];
-	}
+	int* color_keep = &rl->color_counts[(size_t)keep_idx * COLOR_HIST_STRIDE];
+	const int* color_removed = &rl->color_counts[(size_t)remove_idx * COLOR_HIST_STRIDE];
+	for (int i = 0; i < COLOR_HIST_SIZE; i++) color_keep[i] += color_removed[i];
 
-	if (merged.size > 0) {
-		for (int i = 0; i < 25; i++) {
-			merged.color_hist[i] = (float)merged.r[i] / merged.size;
-			merged.color_hist[i + 25] = (float)merged.g[i] / merged.size;
-			merged.color_hist[i + 50] = (float)merged.b[i] / merged.size;
-		}
-	}
+	float* texture_keep = &rl->texture_raw[(size_t)keep_idx * TEXTURE_HIST_STRIDE];
+	const float* texture_removed = &rl->texture_raw[(size_t)remove_idx * TEXTURE_HIST_STRIDE];
+	for (int i = 0; i < TEXTURE_HIST_SIZE; i++) texture_keep[i] += texture_removed[i];
 
-	for (int i = 0; i < 24; i++) {
-		merged.raw_texture_hist[i] = r1->raw_texture_hist[i] + r2->raw_texture_hist[i];
+	// Totals are re-summed from the merged bins rather than added, as merge_regions did.
+	float* total = &rl->texture_total[(size_t)keep_idx * 4];
+	for (int c = 0; c < 3; c++) {
+		total[c] = 0;
+		for (int j = 0; j < 8; j++) total[c] += texture_keep[c * 8 + j];
 	}
 
-	float total_mag_r = 0, total_mag_g = 0, total_mag_b = 0;
-	for (int i = 0; i < 8; i++) total_mag_r += merged.raw_texture_hist[i];
-	for (int i = 0; i < 8; i++) total_mag_g += merged.raw_texture_hist[i + 8];
-	for (int i = 0; i < 8; i++) total_mag_b += merged.raw_texture_hist[i + 16];
-
-	if (total_mag_r > 0) for (int i = 0; i < 8; i++) merged.texture_hist[i] = merged.raw_texture_hist[i] / total_mag_r;
-	else for (int i = 0; i < 8; i++) merged.texture_hist[i] = 0;
+	rl->size[remove_idx] = 0;
 
-	if (total_mag_g > 0) for (int i = 0; i < 8; i++) merged.texture_hist[i + 8] = merged.raw_texture_hist[i + 8] / total_mag_g;
-	else for (int i = 0; i < 8; i++) merged.texture_hist[i + 8] = 0;
+	NeighborSet* keep = &rl->neighbors[keep_idx];
+	NeighborSet* removed = &rl->neighbors[remove_idx];
 
-	if (total_mag_b > 0) for (int i = 0; i < 8; i++) merged.texture_hist[i + 16] = merged.raw_texture_hist[i + 16] / total_mag_b;
-	else for (int i = 0; i < 8; i++) merged.texture_hist[i + 16] = 0;
-
-
-	return merged;
-}
-
-int rl_merge_regions(RegionList* rl, int idx1, int idx2) {
-	if (idx1 == idx2) return -1;
-	int keep_idx = min(idx1, idx2);
-	int remove_idx = max(idx1, idx2);
-
-	rl->regions[keep_idx] = merge_regions(&rl->regions[idx1], &rl->regions[idx2]);
-	rl->regions[remove_idx].size = 0;
-
-	for (int i = 0; i < rl->count; i++) {
-		if (i == keep_idx || rl->regions[i].size == 0) continue;
-		rl->adjacent[keep_idx][i] = rl->adjacent[i][keep_idx] =
-			rl->adjacent[idx1][i] || rl->adjacent[idx2][i];
+	// Neighbours of the removed region now border the kept one instead.
+	for (int n = 0; n < removed->count; n++) {
+		int j = removed->items[n];
+		if (j == keep_idx) continue;
+		ns_remove(&rl->neighbors[j], remove_idx);
+		ns_insert(&rl->neighbors[j], keep_idx);
 	}
 
-	for (int i = 0; i < rl->count; i++) {
-		rl->adjacent[remove_idx][i] = rl->adjacent[i][remove_idx] = false;
+	// The kept region borders the union of both sets, minus the two merged regions.
+	int* merged = (int*)malloc(sizeof(int) * (keep->count + removed->count + 1));
+	if (merged == NULL) {
+		fprintf(stderr, "malloc failed in rl_merge_regions\n");
+		exit(EXIT_FAILURE);
 	}
+	int a = 0, b = 0, count = 0;
+	while (a < keep->count || b < removed->count) {
+		int v;
+		if (b >= removed->count || (a < keep->count && keep->items[a] < removed->items[b])) v = keep->items[a++];
+		else if (a >= keep->count || removed->items[b] < keep->items[a]) v = removed->items[b++];
+		else { v = keep->items[a++]; b++; }
+
+		if (v == keep_idx || v == remove_idx) continue;
+		merged[count++] = v;
+	}
+
+	free(keep->items);
+	keep->items = merged;
+	keep->count = count;
+	keep->capacity = count + 1;
+
+	free(removed->items);
+	removed->items = NULL;
+	removed->count = removed->capacity = 0;
 
 	//rl->count--;
 
@@ -386,40 +511,10 @@ void remove_similarity_entries(SimilarityList* sl, int idx1, int idx2) {
 }
 
 
-static GradientPixel* calculate_gradients(Image* img, int channel) {
-	int width = img->width;
-	int height = img->height;
-	int pixel_count = width * height;
-	GradientPixel* grads = (GradientPixel*)malloc(sizeof(GradientPixel) * pixel_count);
-
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			int idx = y * width + x;
-
-			int x_m1 = (x > 0) ? x - 1 : x;
-			int x_p1 = (x < width - 1) ? x + 1 : x;
-			int y_m1 = (y > 0) ? y - 1 : y;
-			int y_p1 = (y < height - 1) ? y + 1 : y;
-
-			float val_x_m1 = (float)get_pixel_channel(&img->pixels[y * width + x_m1], channel);
-			float val_x_p1 = (float)get_pixel_channel(&img->pixels[y * width + x_p1], channel);
-			float val_y_m1 = (float)get_pixel_channel(&img->pixels[y_m1 * width + x], channel);
-			float val_y_p1 = (float)get_pixel_channel(&img->pixels[y_p1 * width + x], channel);
-
-			float gx = val_x_p1 - val_x_m1;
-			float gy = val_y_p1 - val_y_m1;
-
-			grads[idx].mag = sqrtf(gx * gx + gy * gy);
-			grads[idx].ori = atan2f(gy, gx) + M_PI;
-		}
-	}
-	return grads;
-}
-
 int count_active_regions(RegionList* rl) {
 	int active_count = 0;
 	for (int i = 0; i < rl->count; i++) {
-		if (rl->regions[i].size > 0) {
+		if (rl->size[i] > 0) {
 			active_count++;
 		}
 	}
@@ -448,60 +543,155 @@ void add_bbox(BoundingBoxList* bbl, BoundingBox box) {
 	bbl->boxes[bbl->count++] = box;
 }
 
+// Maps boxes from a from_width x from_height image onto a to_width x to_height one.
+// Each box keeps covering the same source pixels, so it can only grow.
+void scale_bboxes(BoundingBoxList* bbl, int from_width, int from_height, int to_width, int to_height) {
+	double sx = (double)to_width / from_width;
+	double sy = (double)to_height / from_height;
+
+	for (int i = 0; i < bbl->count; i++) {
+		BoundingBox* box = &bbl->boxes[i];
+		box->min_x = (int)floor(box->min_x * sx);
+		box->min_y = (int)floor(box->min_y * sy);
+		box->max_x = (int)ceil((box->max_x + 1) * sx) - 1;
+		box->max_y = (int)ceil((box->max_y + 1) * sy) - 1;
+
+		if (box->max_x > to_width - 1) box->max_x = to_width - 1;
+		if (box->max_y > to_height - 1) box->max_y = to_height - 1;
+	}
+}
 
 // Replaces the selective_search_merge function in selective_search.c with the code below.
 
 void selective_search_merge(RegionList* rl, DisjointSet* ds, BoundingBoxList* bbl, int max_merges, float min_size_factor) {
+	ProposalBudget unlimited = unlimited_proposal_budget();
+	selective_search_merge_budget(rl, ds, bbl, max_merges, min_size_factor, &unlimited);
+}
+
+// Whether a region box is still small enough to be part of an admissible merged box.
+static int rl_box_open(const RegionList* rl, int idx, const ProposalBudget* budget) {
+	if (budget->max_area_ratio <= 0.0f) return 1;
+	const RegionBounds* box = &rl->bounds[idx];
+	long area = (long)(box->max_x - box->min_x) * (box->max_y - box->min_y);
+	return (float)area / rl->img_size <= budget->max_area_ratio;
+}
+
+/*
+selective_search_merge with a ProposalBudget: boxes that fail the budget's geometry limits
+are not emitted. Merged boxes only grow, so merging stops when fewer than two regions are
+left whose box is within max_area_ratio, since every later merged box would contain a box
+that is already too large.
+With max_proposals set, only the best max_proposals of the emitted boxes are kept, best first.
+Merging is not cut short at the count: later merges sit at lower levels and usually outrank
+the boxes emitted before them, so the first boxes out are the lowest ranked ones.
+
+Every emitted box is scored like the selective search ranking, where the root merge of the
+full hierarchy has level 1, the merge before it level 2, and so on. Levels are counted from
+the number of regions the merging started with, so they do not depend on where the loop
+stopped. The random factor of the original ranking is replaced by the merge similarity:
+score = (1 + similarity) / level.
+There is deliberately no strategy term: the random factor is what interleaved the strategies
+in the original ranking, and a deterministic per-strategy weight would only order them. A box
+ranks by its level and similarity alone, whichever strategy emitted it, and equal scores keep
+strategy order in sort_bboxes_by_score.
+*/
+void selective_search_merge_budget(RegionList* rl, DisjointSet* ds, BoundingBoxList* bbl, int max_merges, float min_size_factor, const ProposalBudget* budget) {
 	if (rl->count < 2) return;
 
-	// 1. Calculates initial similarity between adjacent regions.
-	SimilarityList sl;
-	init_similarity_list(&sl, rl->count); // init_similarity_list function required
-	calculate_similarity(rl, &sl);
+	// 1. Queues the initial similarity between adjacent regions.
+	SimilarityHeap sh;
+	sh_init(&sh, rl->count, rl->count);
+	for (int i = 0; i < rl->count; i++) {
+		if (rl->size[i] == 0) continue;
+		NeighborSet* ns = &rl->neighbors[i];
+		for (int n = 0; n < ns->count; n++) {
+			int j = ns->items[n];
+			if (j > i) sh_push(&sh, rl, i, j, min_size_factor);
+		}
+	}
 
 	int merge_count = 0;
 	int active_regions = count_active_regions(rl);
+	int hierarchy_merges = active_regions - 1;  // merges down to a single region
+	long img_area = rl->img_size;
+
+	int first_box = bbl->count;
+	int emitted = 0;
+	int* box_merge = (int*)malloc(sizeof(int) * rl->count);  // merge index of each emitted box
+	if (box_merge == NULL) {
+		fprintf(stderr, "malloc failed in selective_search_merge_budget\n");
+		exit(EXIT_FAILURE);
+	}
+	int open_regions = 0;
+	for (int i = 0; i < rl->count; i++) {
+		if (rl->size[i] > 0 && rl_box_open(rl, i, budget)) open_regions++;
+	}
 
 	// 2. Repeats until there is only one active region or the maximum number of merges is reached.
-	while (sl.count > 0 && active_regions > 1 && merge_count < max_merges) {
-		// Finds the best pair to merge.
-		Similarity* best_sim = get_best_similarity(&sl, rl, min_size_factor);
-		if (!best_sim) break;
-
-		int r_idx1 = best_sim->region_idx1;
-		int r_idx2 = best_sim->region_idx2;
-
-		// 3. Creates a new bounding box and adds it to the list (new).
-		BoundingBox new_box;
-		new_box.min_x = min(rl->regions[r_idx1].min_x, rl->regions[r_idx2].min_x);
-		new_box.min_y = min(rl->regions[r_idx1].min_y, rl->regions[r_idx2].min_y);
-		new_box.max_x = max(rl->regions[r_idx1].max_x, rl->regions[r_idx2].max_x);
-		new_box.max_y = max(rl->regions[r_idx1].max_y, rl->regions[r_idx2].max_y);
-		add_bbox(bbl, new_box);
+	int r_idx1, r_idx2;
+	float similarity;
+	while (active_regions > 1 && merge_count < max_merges && sh_pop(&sh, &r_idx1, &r_idx2, &similarity)) {
+		// 3. Creates a new bounding box and adds it to the list if the budget admits it.
+		//    The similarity is kept in score until the hierarchy level is known.
+		RegionBounds bounds = rl_merged_bounds(rl, r_idx1, r_idx2);
+		BoundingBox merged = { bounds.min_x, bounds.min_y, bounds.max_x, bounds.max_y, similarity };
+		if (box_passes_geometry(merged, img_area, budget)) {
+			add_bbox(bbl, merged);
+			box_merge[emitted++] = merge_count;
+		}
+		open_regions -= rl_box_open(rl, r_idx1, budget) + rl_box_open(rl, r_idx2, budget);
 
-		// 4. Merges regions and updates the similarity list.
-		ds_union(ds, rl->regions[r_idx1].id, rl->regions[r_idx2].id);
+		// 4. Merges regions and updates the queue.
+		ds_union(ds, rl->id[r_idx1], rl->id[r_idx2]);
 
 		int keep_idx = min(r_idx1, r_idx2);
 
-		// Removes all similarity entries related to the merged regions.
-		remove_similarity_entries(&sl, r_idx1, r_idx2);
+		// Drops every queued pair that involves either of the merged regions.
+		sh_invalidate(&sh, r_idx1);
+		sh_invalidate(&sh, r_idx2);
 
 		// Merges the regions.
 		rl_merge_regions(rl, r_idx1, r_idx2);
 
-		// Calculates and adds new similarities for the newly merged region.
-		for (int j = 0; j < rl->count; j++) {
-			if (j == keep_idx || rl->regions[j].size == 0) continue;
-			if (rl->adjacent[keep_idx][j]) {
-				add_similarity(rl, &sl, keep_idx, j);
-			}
+		// Calculates and queues new similarities for the newly merged region.
+		NeighborSet* ns = &rl->neighbors[keep_idx];
+		for (int n = 0; n < ns->count; n++) {
+			sh_push(&sh, rl, keep_idx, ns->items[n], min_size_factor);
 		}
 
 		merge_count++;
 		active_regions--;
+		open_regions += rl_box_open(rl, keep_idx, budget);
+
+		if (open_regions < 2) break;
+	}
+	sh_free(&sh);
+
+	// 5. Levels count back from the root of the full hierarchy.
+	for (int i = 0; i < emitted; i++) {
+		BoundingBox* box = &bbl->boxes[first_box + i];
+		box->score = (1.0f + box->score) / (float)(hierarchy_merges - box_merge[i]);
+	}
+	free(box_merge);
+
+	// 6. Keeps the best max_proposals boxes of this merge; boxes of earlier calls stay as they are.
+	if (budget->max_proposals > 0) {
+		BoundingBoxList own;
+		own.count = emitted;
+		own.capacity = emitted > 0 ? emitted : 1;
+		own.boxes = (BoundingBox*)malloc(sizeof(BoundingBox) * own.capacity);
+		if (own.boxes == NULL) {
+			fprintf(stderr, "malloc failed in selective_search_merge_budget\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(own.boxes, bbl->boxes + first_box, sizeof(BoundingBox) * emitted);
+
+		keep_top_proposals(&own, budget->max_proposals);
+
+		memcpy(bbl->boxes + first_box, own.boxes, sizeof(BoundingBox) * own.count);
+		bbl->count = first_box + own.count;
+		free_bbox_list(&own);
 	}
-	sl_free(&sl);
 }
 
 float calculate_iou(BoundingBox b1, BoundingBox b2) {
@@ -522,46 +712,145 @@ float calculate_iou(BoundingBox b1, BoundingBox b2) {
 	return (union_area > 0) ? (intersection_area / union_area) : 0.0f;
 }
 
-// Added to the bottom of selective_search.c
+// Ranks boxes by score, higher first; equal scores keep their list order.
+typedef struct {
+	float score;
+	int index;
+} ScoredIndex;
 
-// A function that removes duplicate proposal boxes using NMS.
-void non_maximum_suppression(BoundingBoxList* bbl, float iou_threshold) {
-	if (bbl->count == 0) return;
+static bool scored_before(const ScoredIndex* a, const ScoredIndex* b) {
+	if (a->score != b->score) return a->score > b->score;
+	return a->index < b->index;
+}
 
-	// 1. Temporarily assign a score (here, we assume all boxes have the same confidence).
-	//    Instead, we use an array to track the suppression status.
-	bool* is_suppressed = (bool*)calloc(bbl->count, sizeof(bool));
+static int compare_scored_index(const void* p, const void* q) {
+	const ScoredIndex* a = (const ScoredIndex*)p;
+	const ScoredIndex* b = (const ScoredIndex*)q;
+	if (scored_before(a, b)) return -1;
+	return scored_before(b, a) ? 1 : 0;
+}
 
-	// 2. Perform NMS on all pairs of boxes.
+static ScoredIndex* scored_indices(const BoundingBoxList* bbl) {
+	ScoredIndex* order = (ScoredIndex*)malloc(sizeof(ScoredIndex) * (bbl->count > 0 ? bbl->count : 1));
+	if (order == NULL) {
+		fprintf(stderr, "malloc failed in scored_indices\n");
+		exit(EXIT_FAILURE);
+	}
 	for (int i = 0; i < bbl->count; i++) {
-		if (is_suppressed[i]) continue;
+		order[i].score = bbl->boxes[i].score;
+		order[i].index = i;
+	}
+	return order;
+}
 
-		for (int j = i + 1; j < bbl->count; j++) {
-			if (is_suppressed[j]) continue;
+// Rewrites bbl as the first count boxes of order.
+static void bbl_gather(BoundingBoxList* bbl, const ScoredIndex* order, int count) {
+	BoundingBox* boxes = (BoundingBox*)malloc(sizeof(BoundingBox) * (count > 0 ? count : 1));
+	if (boxes == NULL) {
+		fprintf(stderr, "malloc failed in bbl_gather\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < count; i++) boxes[i] = bbl->boxes[order[i].index];
 
-			float iou = calculate_iou(bbl->boxes[i], bbl->boxes[j]);
+	free(bbl->boxes);
+	bbl->boxes = boxes;
+	bbl->count = count;
+	bbl->capacity = count > 0 ? count : 1;
+}
 
-			// If the IoU with box i (which has a higher score) is above the threshold, suppress box j.
-			if (iou > iou_threshold) {
-				is_suppressed[j] = true;
-			}
-		}
-	}
+// Sorts the boxes by score, best first. Ties keep their list order, so boxes of the same
+// level come out in strategy order.
+void sort_bboxes_by_score(BoundingBoxList* bbl) {
+	if (bbl->count < 2) return;
+	ScoredIndex* order = scored_indices(bbl);
+	qsort(order, bbl->count, sizeof(ScoredIndex), compare_scored_index);
+	bbl_gather(bbl, order, bbl->count);
+	free(order);
+}
+
+// A function that removes duplicate proposal boxes using NMS.
+// The boxes are sorted by score once; each one is then only compared with the boxes kept
+// so far and dropped at the first overlap. The result stays in score order.
+void non_maximum_suppression(BoundingBoxList* bbl, float iou_threshold) {
+	if (bbl->count == 0) return;
 
-	// 3. Rebuild the BoundingBoxList with only the unsuppressed boxes.
+	// 1. Highest score first.
+	sort_bboxes_by_score(bbl);
+
+	// 2. Keep a box unless it overlaps one that was already kept.
 	BoundingBoxList filtered_bbl;
 	init_bbox_list(&filtered_bbl);
 	for (int i = 0; i < bbl->count; i++) {
-		if (!is_suppressed[i]) {
-			add_bbox(&filtered_bbl, bbl->boxes[i]);
+		bool is_suppressed = false;
+		for (int j = 0; j < filtered_bbl.count; j++) {
+			if (calculate_iou(filtered_bbl.boxes[j], bbl->boxes[i]) > iou_threshold) {
+				is_suppressed = true;
+				break;
+			}
 		}
+		if (!is_suppressed) add_bbox(&filtered_bbl, bbl->boxes[i]);
 	}
 
 	// Replace the original list with the filtered list.
 	free(bbl->boxes);
 	*bbl = filtered_bbl;
+}
+
+// Sifts entry i down a heap that keeps its worst entry at the root.
+static void worst_heap_sift_down(ScoredIndex* heap, int n, int i) {
+	ScoredIndex e = heap[i];
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= n) break;
+		if (child + 1 < n && scored_before(&heap[child], &heap[child + 1])) child++;
+		if (!scored_before(&e, &heap[child])) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = e;
+}
+
+// Keeps the n best boxes by score, best first, with a heap of n entries instead of a full sort.
+void keep_top_proposals(BoundingBoxList* bbl, int n) {
+	if (n < 0) n = 0;
+	if (bbl->count <= n) {
+		sort_bboxes_by_score(bbl);
+		return;
+	}
+
+	ScoredIndex* order = scored_indices(bbl);
+
+	// The first n boxes start the heap; every later one replaces the worst if it ranks higher.
+	for (int i = n / 2 - 1; i >= 0; i--) worst_heap_sift_down(order, n, i);
+	for (int i = n; i < bbl->count; i++) {
+		if (n > 0 && scored_before(&order[i], &order[0])) {
+			order[0] = order[i];
+			worst_heap_sift_down(order, n, 0);
+		}
+	}
+
+	qsort(order, n, sizeof(ScoredIndex), compare_scored_index);
+	bbl_gather(bbl, order, n);
+	free(order);
+}
 
-	free(is_suppressed);
+/*
+Final proposal set of the pipeline: score-ordered NMS, the geometry filter, then the
+max_proposals best boxes (all of them when max_proposals is 0). The result is in score order.
+Nested boxes are kept: a high-level box contains most of the boxes below it, so removing
+nested boxes after score-ordered NMS would leave only the top of the hierarchy.
+*/
+void select_final_proposals(BoundingBoxList* bbl, int img_width, int img_height, float iou_threshold, int max_proposals) {
+	non_maximum_suppression(bbl, iou_threshold);
+	printf("Filtered to %d proposals after NMS.\n", bbl->count);
+
+	filter_proposals_by_geometry(bbl, img_width, img_height);
+	printf("Filtered to %d proposals after geometry filtering.\n", bbl->count);
+
+	if (max_proposals > 0) {
+		keep_top_proposals(bbl, max_proposals);
+		printf("Kept the %d best proposals.\n", bbl->count);
+	}
 }
 
 // A function that checks if one box (b2) is fully contained within another (b1).
@@ -605,35 +894,51 @@ void filter_nested_boxes(BoundingBoxList* bbl) {
 
 // Add this entire function to the bottom of selective_search.c.
 
-void filter_proposals_by_geometry(BoundingBoxList* bbl, int img_width, int img_height) {
-	BoundingBoxList filtered_bbl;
-	init_bbox_list(&filtered_bbl);
+ProposalBudget default_proposal_budget(void) {
+	ProposalBudget budget;
+	budget.max_proposals = 0;
+	budget.min_area_ratio = 0.001f;  // Filters out boxes smaller than 0.1% of the total image size.
+	budget.max_area_ratio = 0.95f;   // Filters out boxes larger than 95% of the total image size.
+	budget.max_aspect_ratio = 10.0f; // Filters out boxes with an aspect ratio (width/height or height/width) greater than 10.
+	return budget;
+}
 
-	float min_size_ratio = 0.001f;  // Filters out boxes smaller than 0.1% of the total image size.
-	float max_size_ratio = 0.95f;   // Filters out boxes larger than 95% of the total image size.
-	float max_aspect_ratio = 10.0f; // Filters out boxes with an aspect ratio (width/height or height/width) greater than 10.
-	long img_area = (long)img_width * img_height;
+ProposalBudget unlimited_proposal_budget(void) {
+	ProposalBudget budget;
+	memset(&budget, 0, sizeof(budget));
+	return budget;
+}
 
-	for (int i = 0; i < bbl->count; i++) {
-		BoundingBox box = bbl->boxes[i];
-		long box_w = box.max_x - box.min_x;
-		long box_h = box.max_y - box.min_y;
+// The geometry test of filter_proposals_by_geometry, with the limits taken from budget.
+bool box_passes_geometry(BoundingBox box, long img_area, const ProposalBudget* budget) {
+	long box_w = box.max_x - box.min_x;
+	long box_h = box.max_y - box.min_y;
 
-		if (box_w <= 0 || box_h <= 0) continue;
+	// A flat box has zero area and an unbounded aspect ratio.
+	if (box_w <= 0 || box_h <= 0) return budget->min_area_ratio <= 0.0f && budget->max_aspect_ratio <= 0.0f;
 
-		// Size filtering
-		long box_area = box_w * box_h;
-		if ((float)box_area / img_area < min_size_ratio || (float)box_area / img_area > max_size_ratio) {
-			continue;
-		}
+	// Size filtering
+	long box_area = box_w * box_h;
+	if (budget->min_area_ratio > 0.0f && (float)box_area / img_area < budget->min_area_ratio) return false;
+	if (budget->max_area_ratio > 0.0f && (float)box_area / img_area > budget->max_area_ratio) return false;
 
-		// Aspect ratio filtering
+	// Aspect ratio filtering
+	if (budget->max_aspect_ratio > 0.0f) {
 		float aspect_ratio = (float)box_w / box_h;
-		if (aspect_ratio > max_aspect_ratio || aspect_ratio < (1.0f / max_aspect_ratio)) {
-			continue;
-		}
+		if (aspect_ratio > budget->max_aspect_ratio || aspect_ratio < (1.0f / budget->max_aspect_ratio)) return false;
+	}
+	return true;
+}
+
+void filter_proposals_by_geometry(BoundingBoxList* bbl, int img_width, int img_height) {
+	BoundingBoxList filtered_bbl;
+	init_bbox_list(&filtered_bbl);
+
+	ProposalBudget budget = default_proposal_budget();
+	long img_area = (long)img_width * img_height;
 
-		add_bbox(&filtered_bbl, box);
+	for (int i = 0; i < bbl->count; i++) {
+		if (box_passes_geometry(bbl->boxes[i], img_area, &budget)) add_bbox(&filtered_bbl, bbl->boxes[i]);
 	}
 
 	// Replace the original list with the filtered list.
@@ -649,63 +954,136 @@ void init_similarity_list(SimilarityList* sl, int initial_capacity) {
 	sl->similarities = (Similarity*)malloc(sizeof(Similarity) * sl->capacity);
 }
 
+SimilarityWeights default_similarity_weights(void) {
+    SimilarityWeights w;
+    w.color = W_COLOR;
+    w.texture = W_TEXTURE;
+    w.size = W_SIZE;
+    w.fill = W_FILL;
+    return w;
+}
+
 // Implementation of the Selective Search pipeline function.
 BoundingBoxList run_selective_search_pipeline(Image* original_img, ColorSpaceType cs_type, float k, float min_size_factor, float iou_threshold) {
+    SelectiveSearchStrategy strategy;
+    strategy.color_space = cs_type;
+    strategy.k = k;
+    strategy.sigma = 2.0f;
+    strategy.weights = default_similarity_weights();
+    strategy.min_size = GBS_MIN_REGION_SIZE;
+    strategy.budget = unlimited_proposal_budget();
+
+    return run_selective_search_strategy(original_img, &strategy, min_size_factor);
+}
+
+// Runs one strategy. Only reads original_img, so several strategies can run on it at once.
+BoundingBoxList run_selective_search_strategy(Image* original_img, const SelectiveSearchStrategy* strategy, float min_size_factor) {
+    ImageFeatures features;
+    image_features_init(&features, original_img);
+
+    BoundingBoxList proposals = run_selective_search_strategy_cached(&features, strategy, min_size_factor);
+
+    image_features_free(&features);
+    return proposals;
+}
+
+// Runs one strategy on products borrowed from features, computing the missing ones on the way.
+BoundingBoxList run_selective_search_strategy_cached(ImageFeatures* features, const SelectiveSearchStrategy* strategy, float min_size_factor) {
+    ColorSpaceType cs_type = strategy->color_space;
+    float k = strategy->k;
     const char* cs_name = (cs_type == COLOR_SPACE_RGB) ? "RGB" : "Lab";
     printf("\n--- Running Pipeline for Color Space: %s (k=%.1f) ---\n", cs_name, k);
 
     BoundingBoxList final_proposals;
     init_bbox_list(&final_proposals);
 
-    Image base_img = copy_image(original_img);
-    Image color_img; // The color image used for feature extraction.
-    Image gbs_img;   // The input image for Graph-Based Segmentation.
-
-    bool conversion_ok = false;
-    switch (cs_type) {
-    case COLOR_SPACE_RGB:
-        color_img = copy_image(&base_img);
-        gbs_img = copy_image(&base_img);
-        conversion_ok = (color_img.pixels && gbs_img.pixels);
-        break;
-    case COLOR_SPACE_LAB_L_CHANNEL:
-        convert_image_to_lab(&base_img, &color_img);
-        gbs_img.width = color_img.width; gbs_img.height = color_img.height; gbs_img.channels = 1;
-        gbs_img.pixels = (Pixel*)malloc(sizeof(Pixel) * gbs_img.width * gbs_img.height);
-        if (gbs_img.pixels) {
-            for (int i = 0; i < gbs_img.width * gbs_img.height; i++) gbs_img.pixels[i].r = color_img.pixels[i].r;
-        }
-        conversion_ok = (color_img.pixels && gbs_img.pixels);
-        break;
-    }
-
-    if (!conversion_ok) {
-        fprintf(stderr, "Error during image preparation for colorspace %d\n", cs_type);
-        free(base_img.pixels);
-        return final_proposals;
-    }
-
     // --- GBS, SS, and Filtering (same process for all color spaces) ---
+    const Image* color_img = image_features_color(features, cs_type);
+    const CompactEdgeList* edges = image_features_edges(features, cs_type, strategy->sigma);
+    const TextureGradients* gradients = image_features_shared_gradients(features, cs_type);
+
     DisjointSet ds;
-    if (cs_type == COLOR_SPACE_LAB_L_CHANNEL) {
-        graph_based_segmentation_grayscale(&ds, &gbs_img, k);
-    }
-    else {
-        graph_based_segmentation(&ds, &gbs_img, k, 2.0f);
-    }
+    int small_merged = graph_based_segmentation_edges(&ds, edges, color_img->width * color_img->height, k, strategy->min_size);
 
-    RegionList rl = create_regions(&color_img, &ds);
-    printf("Before merge: %d active regions\n", count_active_regions(&rl));
+    RegionList rl = create_regions_with_gradients(color_img, &ds, gradients);
+    rl.weights = strategy->weights;
+    int active = count_active_regions(&rl);
+    if (small_merged > 0) {
+        printf("Min region size %d: %d -> %d initial regions\n", strategy->min_size, active + small_merged, active);
+    }
+    printf("Before merge: %d active regions\n", active);
 
-    selective_search_merge(&rl, &ds, &final_proposals, 10000, min_size_factor);
+    selective_search_merge_budget(&rl, &ds, &final_proposals, 10000, min_size_factor, &strategy->budget);
 
-    // Free intermediate memory.
-    free(base_img.pixels);
-    free(color_img.pixels);
-    free(gbs_img.pixels);
     ds_free(&ds);
     rl_free(&rl);
 
     printf("Pipeline for %s finished. Generated %d proposals.\n", cs_name, final_proposals.count);
     return final_proposals;
+}
+
+// Runs every strategy, one per OpenMP thread, and concatenates the proposals in strategy order.
+// The result does not depend on the number of threads or on which strategy finishes first.
+BoundingBoxList run_selective_search_strategies(Image* original_img, const SelectiveSearchStrategy* strategies, int count, float min_size_factor) {
+    BoundingBoxList* results = (BoundingBoxList*)malloc(sizeof(BoundingBoxList) * (count > 0 ? count : 1));
+    if (results == NULL) {
+        fprintf(stderr, "malloc failed in run_selective_search_strategies\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Lazily built tables are set up here, before any worker can race on them.
+    histogram_kernels();
+    color_convert_init();
+
+    // Strategies sharing a colour space or sigma borrow the same converted image, gradients and edges.
+    ImageFeatures features;
+    image_features_init(&features, original_img);
+    for (int i = 0; i < count; i++) image_features_expect(&features, strategies[i].color_space);
+
+#pragma omp parallel for schedule(dynamic, 1) if(count > 1)
+    for (int i = 0; i < count; i++) {
+        results[i] = run_selective_search_strategy_cached(&features, &strategies[i], min_size_factor);
+    }
+
+    image_features_free(&features);
+
+    BoundingBoxList proposals;
+    init_bbox_list(&proposals);
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < results[i].count; j++) add_bbox(&proposals, results[i].boxes[j]);
+        free_bbox_list(&results[i]);
+    }
+    free(results);
+
+    return proposals;
+}
+
+// Runs the strategies at a working resolution and maps the proposals back to original_img.
+// original_img is not modified, so the same decoded image can be reused for other budgets.
+BoundingBoxList run_selective_search_strategies_scaled(Image* original_img, const SelectiveSearchStrategy* strategies, int count, float min_size_factor, int max_long_side, int max_pixels) {
+    Image working_img;
+    int resized = downsample_image(original_img, &working_img, max_long_side, max_pixels);
+    if (resized) {
+        printf("\nWorking resolution: %d x %d -> %d x %d\n", original_img->width, original_img->height, working_img.width, working_img.height);
+    }
+
+    BoundingBoxList proposals = run_selective_search_strategies(&working_img, strategies, count, min_size_factor);
+
+    if (resized) {
+        scale_bboxes(&proposals, working_img.width, working_img.height, original_img->width, original_img->height);
+        free_image(&working_img);
+    }
+    return proposals;
+}
+
+BoundingBoxList run_selective_search_pipeline_scaled(Image* original_img, ColorSpaceType cs_type, float k, float min_size_factor, int max_long_side, int max_pixels) {
+    SelectiveSearchStrategy strategy;
+    strategy.color_space = cs_type;
+    strategy.k = k;
+    strategy.sigma = 2.0f;
+    strategy.weights = default_similarity_weights();
+    strategy.min_size = GBS_MIN_REGION_SIZE;
+    strategy.budget = unlimited_proposal_budget();
+
+    return run_selective_search_strategies_scaled(original_img, &strategy, 1, min_size_factor, max_long_side, max_pixels);
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 
 #include "image.h"
 #include "disjoint_set.h"
+#include "texture.h"
 #include <stdbool.h>
 
 // --- Macro Definitions ---
@@ -13,29 +14,66 @@
 #define COLOR_HIST_SIZE (COLOR_BINS * 3)
 #define TEXTURE_HIST_SIZE (TEXTURE_BINS * 3)
 
+// Per-region row lengths in the RegionList arrays, padded to whole 32-byte lines.
+#define COLOR_HIST_STRIDE 80
+#define TEXTURE_HIST_STRIDE 24
+
 #define W_COLOR   2.0f
 #define W_TEXTURE 0.5f
 #define W_SIZE    1.0f
 #define W_FILL    1.5f
 
+// Number of proposals select_final_proposals keeps for the demo pipeline in main.
+#define FINAL_PROPOSAL_COUNT 20
+
 // --- Structure Definitions ---
+// Extent of a region, in inclusive pixel coordinates.
+typedef struct {
+    int min_x, min_y, max_x, max_y;
+} RegionBounds;
+
+// A proposal box; score ranks proposals, higher first.
+// The score is (1 + merge similarity) / hierarchy level and has no strategy term, so boxes
+// of all strategies are ranked on one scale (see selective_search_merge_budget).
 typedef struct {
-    int id;
-    int size;
     int min_x, min_y, max_x, max_y;
-    float color_hist[COLOR_HIST_SIZE];
-    int r[COLOR_BINS], g[COLOR_BINS], b[COLOR_BINS];
-    float texture_hist[TEXTURE_HIST_SIZE];
-    float raw_texture_hist[TEXTURE_HIST_SIZE];
-} Region;
+    float score;
+} BoundingBox;
 
+// Weights of the four similarity terms. Scores are normalized by the best possible sum.
+typedef struct {
+    float color;
+    float texture;
+    float size;
+    float fill;
+} SimilarityWeights;
+
+// Sorted indices of the regions that share a boundary with one region.
+typedef struct {
+    int* items;
+    int count;
+    int capacity;
+} NeighborSet;
+
+/*
+Regions stored as parallel arrays indexed by region.
+Only counts are kept: the normalized colour histogram is color_counts / size and the
+normalized texture histogram is texture_raw / texture_total, both derived when two
+regions are compared. Merging adds the counts of the removed region into the kept one.
+*/
 typedef struct {
-    Region* regions;
     int count;
     int capacity;
     int img_size;
+    int* id;               // a pixel of the region, used for ds_union
+    int* size;             // 0 once the region is merged away
+    RegionBounds* bounds;
+    int* color_counts;     // COLOR_HIST_STRIDE per region: 25 r bins, 25 g bins, 25 b bins
+    float* texture_raw;    // TEXTURE_HIST_STRIDE per region: 8 orientation bins per channel
+    float* texture_total;  // 4 per region: sum of each channel's texture bins
     int* pixel_to_region;
-    bool** adjacent;
+    NeighborSet* neighbors;  // one per region, empty once the region is merged away
+    SimilarityWeights weights;
 } RegionList;
 
 typedef struct {
@@ -50,9 +88,23 @@ typedef struct {
     int capacity;
 } SimilarityList;
 
+// Max-heap of candidate merges with lazy deletion.
+// Every region carries a version that is bumped when it takes part in a merge;
+// entries whose stored versions no longer match are stale and dropped on pop.
 typedef struct {
-    int min_x, min_y, max_x, max_y;
-} BoundingBox;
+    float score;        // boosted similarity, fixed for the lifetime of the entry
+    int seq;            // insertion order, breaks ties the same way the linear scan did
+    int region_idx1, region_idx2;
+    int version1, version2;
+} SimilarityHeapEntry;
+
+typedef struct {
+    SimilarityHeapEntry* entries;
+    int count;
+    int capacity;
+    int next_seq;
+    int* versions;      // one per region
+} SimilarityHeap;
 
 typedef struct {
     BoundingBox* boxes;
@@ -63,17 +115,42 @@ typedef struct {
 // Defines the color space types used in the pipeline.
 typedef enum {
     COLOR_SPACE_RGB,
-    COLOR_SPACE_LAB_L_CHANNEL
+    COLOR_SPACE_LAB_L_CHANNEL,
+    COLOR_SPACE_COUNT
 } ColorSpaceType;
 
+// Limits on the boxes one strategy emits; a field left at zero sets no limit.
+// The geometry limits are the ones filter_proposals_by_geometry applies, so boxes it would
+// drop are not emitted in the first place.
+typedef struct {
+    int max_proposals;       // keeps this many admissible boxes, the best by score
+    float min_area_ratio;    // box area / image area
+    float max_area_ratio;
+    float max_aspect_ratio;  // larger of width / height and height / width
+} ProposalBudget;
+
+// One selective search configuration.
+// sigma is the pre-blur of the segmentation; the Lab strategy segments the unblurred L plane.
+// GBS components smaller than min_size pixels are joined to a neighbour before regions are built.
+typedef struct {
+    ColorSpaceType color_space;
+    float k;
+    float sigma;
+    SimilarityWeights weights;
+    int min_size;
+    ProposalBudget budget;
+} SelectiveSearchStrategy;
+
 // --- Function Prototypes ---
 
 // RegionList Functions
 void init_region_list(RegionList* rl);
 void rl_free(RegionList* rl);
-RegionList create_regions(Image* img, DisjointSet* ds);
+RegionList create_regions(const Image* img, DisjointSet* ds);
+RegionList create_regions_with_gradients(const Image* img, DisjointSet* ds, const TextureGradients* gradients);
 int rl_merge_regions(RegionList* rl, int idx1, int idx2);
-Region merge_regions(Region* r1, Region* r2);
+RegionBounds rl_merged_bounds(const RegionList* rl, int idx1, int idx2);
+bool rl_are_adjacent(const RegionList* rl, int idx1, int idx2);
 
 // SimilarityList Functions
 void init_similarity_list(SimilarityList* sl, int initial_capacity);
@@ -83,26 +160,52 @@ void remove_similarity_entries(SimilarityList* sl, int idx1, int idx2);
 void sl_free(SimilarityList* sl);
 Similarity* get_best_similarity(SimilarityList* sl, RegionList* rl, float min_size_factor);
 
+// SimilarityHeap Functions
+void sh_init(SimilarityHeap* sh, int region_count, int initial_capacity);
+void sh_push(SimilarityHeap* sh, RegionList* rl, int idx1, int idx2, float min_size_factor);
+bool sh_pop(SimilarityHeap* sh, int* idx1, int* idx2, float* score);
+void sh_invalidate(SimilarityHeap* sh, int region_idx);
+void sh_free(SimilarityHeap* sh);
+
 // Similarity Calculation Functions
-float color_similarity(Region* region1, Region* region2);
-float texture_similarity(Region* region1, Region* region2);
-float size_similarity(Region* region1, Region* region2, int img_size);
-float fill_similarity(Region* region1, Region* region2, int img_size);
+float color_similarity(const RegionList* rl, int idx1, int idx2);
+float texture_similarity(const RegionList* rl, int idx1, int idx2);
+float size_similarity(const RegionList* rl, int idx1, int idx2);
+float fill_similarity(const RegionList* rl, int idx1, int idx2);
+float combined_similarity(const RegionList* rl, int idx1, int idx2);
 
 // Main Algorithm
 void selective_search_merge(RegionList* rl, DisjointSet* ds, BoundingBoxList* bbl, int max_merges, float min_size_factor);
+void selective_search_merge_budget(RegionList* rl, DisjointSet* ds, BoundingBoxList* bbl, int max_merges, float min_size_factor, const ProposalBudget* budget);
 BoundingBoxList run_selective_search_pipeline(Image* original_img, ColorSpaceType cs_type, float k, float min_size_factor, float iou_threshold);
+BoundingBoxList run_selective_search_pipeline_scaled(Image* original_img, ColorSpaceType cs_type, float k, float min_size_factor, int max_long_side, int max_pixels);
+
+// Strategy sets
+SimilarityWeights default_similarity_weights(void);
+ProposalBudget default_proposal_budget(void);
+ProposalBudget unlimited_proposal_budget(void);
+BoundingBoxList run_selective_search_strategy(Image* original_img, const SelectiveSearchStrategy* strategy, float min_size_factor);
+// Same as run_selective_search_strategy, borrowing the converted image, gradients and edges from features.
+struct ImageFeatures;
+BoundingBoxList run_selective_search_strategy_cached(struct ImageFeatures* features, const SelectiveSearchStrategy* strategy, float min_size_factor);
+BoundingBoxList run_selective_search_strategies(Image* original_img, const SelectiveSearchStrategy* strategies, int count, float min_size_factor);
+BoundingBoxList run_selective_search_strategies_scaled(Image* original_img, const SelectiveSearchStrategy* strategies, int count, float min_size_factor, int max_long_side, int max_pixels);
 
 // BoundingBox Functions
 void init_bbox_list(BoundingBoxList* bbl);
 void free_bbox_list(BoundingBoxList* bbl);
 void add_bbox(BoundingBoxList* bbl, BoundingBox box);
+void scale_bboxes(BoundingBoxList* bbl, int from_width, int from_height, int to_width, int to_height);
 
 // Post-processing Functions
 float calculate_iou(BoundingBox b1, BoundingBox b2);
+void sort_bboxes_by_score(BoundingBoxList* bbl);
 void non_maximum_suppression(BoundingBoxList* bbl, float iou_threshold);
+void keep_top_proposals(BoundingBoxList* bbl, int n);
+void select_final_proposals(BoundingBoxList* bbl, int img_width, int img_height, float iou_threshold, int max_proposals);
 void filter_nested_boxes(BoundingBoxList* bbl);
 void filter_proposals_by_geometry(BoundingBoxList* bbl, int img_width, int img_height);
+bool box_passes_geometry(BoundingBox box, long img_area, const ProposalBudget* budget);
 bool is_box_fully_contained(BoundingBox b1, BoundingBox b2);
 
 // Utility
@@ -0,0 +1,74 @@
+#include "simd.h"
+
+#if defined(SIMD_X86) && !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
+
+#ifdef SIMD_X86
+static void cpuid(int leaf, int subleaf, unsigned int regs[4]) {
+#ifdef _MSC_VER
+	int r[4];
+	__cpuidex(r, leaf, subleaf);
+	for (int i = 0; i < 4; i++) regs[i] = (unsigned int)r[i];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the OS saves on context switches (XCR0).
+static unsigned long long xgetbv0(void) {
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+static SimdLevel simd_detect_once(void) {
+	unsigned int regs[4];
+	cpuid(0, 0, regs);
+	unsigned int max_leaf = regs[0];
+
+	cpuid(1, 0, regs);
+	if (!(regs[3] & (1u << 26))) return SIMD_LEVEL_SCALAR;
+
+	int osxsave = (regs[2] & (1u << 27)) != 0;
+	int avx = (regs[2] & (1u << 28)) != 0;
+	if (!osxsave || !avx || max_leaf < 7) return SIMD_LEVEL_SSE2;
+
+	unsigned long long xcr0 = xgetbv0();
+	if ((xcr0 & 0x6) != 0x6) return SIMD_LEVEL_SSE2;
+
+	cpuid(7, 0, regs);
+	int avx2 = (regs[1] & (1u << 5)) != 0;
+	int avx512f = (regs[1] & (1u << 16)) != 0;
+	if (!avx2) return SIMD_LEVEL_SSE2;
+
+	// opmask, upper ZMM halves and ZMM16-31 all have to be enabled.
+	if (avx512f && (xcr0 & 0xE0) == 0xE0) return SIMD_LEVEL_AVX512;
+	return SIMD_LEVEL_AVX2;
+}
+#endif
+
+SimdLevel simd_detect(void) {
+	static volatile int detected = -1;
+	if (detected < 0) {
+#ifdef SIMD_X86
+		detected = (int)simd_detect_once();
+#else
+		detected = (int)SIMD_LEVEL_SCALAR;
+#endif
+	}
+	return (SimdLevel)detected;
+}
+
+const char* simd_level_name(SimdLevel level) {
+	switch (level) {
+	case SIMD_LEVEL_SSE2: return "SSE2";
+	case SIMD_LEVEL_AVX2: return "AVX2";
+	case SIMD_LEVEL_AVX512: return "AVX-512";
+	default: return "scalar";
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <stdlib.h>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+/*
+Compile-time SIMD detection.
+SSE2 is part of every x64 target, and 32-bit MSVC builds get it with /arch:SSE2.
+Code that uses these paths keeps a scalar fallback for other targets.
+*/
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// x86 targets can also carry AVX2 and AVX-512 kernels, picked at run time with simd_detect.
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// Lets GCC and Clang compile one function for a wider instruction set than the rest of the file.
+// MSVC accepts the intrinsics anywhere, so the macros are empty there.
+#if defined(SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+#endif
+
+typedef enum {
+	SIMD_LEVEL_SCALAR,
+	SIMD_LEVEL_SSE2,
+	SIMD_LEVEL_AVX2,
+	SIMD_LEVEL_AVX512
+} SimdLevel;
+
+// Widest instruction set both the CPU and the OS support. Detected once.
+SimdLevel simd_detect(void);
+
+const char* simd_level_name(SimdLevel level);
+
+#define SIMD_ALIGNMENT 64
+
+// Allocates size bytes aligned to SIMD_ALIGNMENT. Free with simd_free.
+static inline void* simd_malloc(size_t size) {
+#ifdef _MSC_VER
+	return _aligned_malloc(size, SIMD_ALIGNMENT);
+#else
+	void* ptr = NULL;
+	if (posix_memalign(&ptr, SIMD_ALIGNMENT, size) != 0) return NULL;
+	return ptr;
+#endif
+}
+
+static inline void simd_free(void* ptr) {
+#ifdef _MSC_VER
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+#endif // !__SIMD_H__
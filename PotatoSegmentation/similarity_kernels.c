@@ -0,0 +1,186 @@
+#include "similarity_kernels.h"
+
+#include <math.h>
+
+#define COLOR_LANES 80
+#define TEXTURE_CHANNELS 3
+
+static float reduce8(const float acc[8]) {
+	float s0 = acc[0] + acc[4];
+	float s1 = acc[1] + acc[5];
+	float s2 = acc[2] + acc[6];
+	float s3 = acc[3] + acc[7];
+	return (s0 + s2) + (s1 + s3);
+}
+
+static float color_intersection_scalar(const int* h1, const int* h2, float size1, float size2) {
+	float acc[8] = { 0 };
+	for (int k = 0; k < COLOR_LANES; k++) {
+		acc[k & 7] += fminf((float)h1[k] / size1, (float)h2[k] / size2);
+	}
+	return reduce8(acc);
+}
+
+static float texture_intersection_scalar(const float* h1, const float* h2, const float* total1, const float* total2) {
+	float acc[8] = { 0 };
+	for (int c = 0; c < TEXTURE_CHANNELS; c++) {
+		for (int j = 0; j < 8; j++) {
+			float t1 = (total1[c] > 0) ? h1[c * 8 + j] / total1[c] : 0;
+			float t2 = (total2[c] > 0) ? h2[c * 8 + j] / total2[c] : 0;
+			acc[j] += fminf(t1, t2);
+		}
+	}
+	return reduce8(acc);
+}
+
+static const HistogramKernels kernels_scalar = {
+	SIMD_LEVEL_SCALAR, color_intersection_scalar, texture_intersection_scalar
+};
+
+#ifdef SIMD_SSE2
+// lo holds partial sums 0-3 and hi 4-7; reduces them in the order reduce8 uses.
+static inline float reduce_sse2(__m128 lo, __m128 hi) {
+	__m128 s = _mm_add_ps(lo, hi);
+	__m128 t = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	return _mm_cvtss_f32(_mm_add_ss(t, _mm_shuffle_ps(t, t, 1)));
+}
+
+static float color_intersection_sse2(const int* h1, const int* h2, float size1, float size2) {
+	__m128 s1 = _mm_set1_ps(size1);
+	__m128 s2 = _mm_set1_ps(size2);
+	__m128 lo = _mm_setzero_ps();
+	__m128 hi = _mm_setzero_ps();
+
+	for (int k = 0; k < COLOR_LANES; k += 8) {
+		__m128 a = _mm_div_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(h1 + k))), s1);
+		__m128 b = _mm_div_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(h2 + k))), s2);
+		lo = _mm_add_ps(lo, _mm_min_ps(a, b));
+
+		a = _mm_div_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(h1 + k + 4))), s1);
+		b = _mm_div_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(h2 + k + 4))), s2);
+		hi = _mm_add_ps(hi, _mm_min_ps(a, b));
+	}
+	return reduce_sse2(lo, hi);
+}
+
+static float texture_intersection_sse2(const float* h1, const float* h2, const float* total1, const float* total2) {
+	__m128 lo = _mm_setzero_ps();
+	__m128 hi = _mm_setzero_ps();
+
+	for (int c = 0; c < TEXTURE_CHANNELS; c++) {
+		__m128 a_lo = _mm_setzero_ps(), a_hi = _mm_setzero_ps();
+		__m128 b_lo = _mm_setzero_ps(), b_hi = _mm_setzero_ps();
+		if (total1[c] > 0) {
+			__m128 t = _mm_set1_ps(total1[c]);
+			a_lo = _mm_div_ps(_mm_loadu_ps(h1 + c * 8), t);
+			a_hi = _mm_div_ps(_mm_loadu_ps(h1 + c * 8 + 4), t);
+		}
+		if (total2[c] > 0) {
+			__m128 t = _mm_set1_ps(total2[c]);
+			b_lo = _mm_div_ps(_mm_loadu_ps(h2 + c * 8), t);
+			b_hi = _mm_div_ps(_mm_loadu_ps(h2 + c * 8 + 4), t);
+		}
+		lo = _mm_add_ps(lo, _mm_min_ps(a_lo, b_lo));
+		hi = _mm_add_ps(hi, _mm_min_ps(a_hi, b_hi));
+	}
+	return reduce_sse2(lo, hi);
+}
+
+static const HistogramKernels kernels_sse2 = {
+	SIMD_LEVEL_SSE2, color_intersection_sse2, texture_intersection_sse2
+};
+#endif
+
+#ifdef SIMD_X86
+SIMD_TARGET_AVX2
+static inline float reduce_avx2(__m256 acc) {
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	__m128 t = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	return _mm_cvtss_f32(_mm_add_ss(t, _mm_shuffle_ps(t, t, 1)));
+}
+
+SIMD_TARGET_AVX2
+static float color_intersection_avx2(const int* h1, const int* h2, float size1, float size2) {
+	__m256 s1 = _mm256_set1_ps(size1);
+	__m256 s2 = _mm256_set1_ps(size2);
+	__m256 acc = _mm256_setzero_ps();
+
+	for (int k = 0; k < COLOR_LANES; k += 8) {
+		__m256 a = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(h1 + k))), s1);
+		__m256 b = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(h2 + k))), s2);
+		acc = _mm256_add_ps(acc, _mm256_min_ps(a, b));
+	}
+	return reduce_avx2(acc);
+}
+
+SIMD_TARGET_AVX2
+static float texture_intersection_avx2(const float* h1, const float* h2, const float* total1, const float* total2) {
+	__m256 acc = _mm256_setzero_ps();
+
+	for (int c = 0; c < TEXTURE_CHANNELS; c++) {
+		__m256 a = _mm256_setzero_ps();
+		__m256 b = _mm256_setzero_ps();
+		if (total1[c] > 0) a = _mm256_div_ps(_mm256_loadu_ps(h1 + c * 8), _mm256_set1_ps(total1[c]));
+		if (total2[c] > 0) b = _mm256_div_ps(_mm256_loadu_ps(h2 + c * 8), _mm256_set1_ps(total2[c]));
+		acc = _mm256_add_ps(acc, _mm256_min_ps(a, b));
+	}
+	return reduce_avx2(acc);
+}
+
+// 16 bins per step; the two 8-bin halves are added in order so the partial sums match.
+SIMD_TARGET_AVX512
+static float color_intersection_avx512(const int* h1, const int* h2, float size1, float size2) {
+	__m512 s1 = _mm512_set1_ps(size1);
+	__m512 s2 = _mm512_set1_ps(size2);
+	__m256 acc = _mm256_setzero_ps();
+
+	for (int k = 0; k < COLOR_LANES; k += 16) {
+		__m512 a = _mm512_div_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512((const void*)(h1 + k))), s1);
+		__m512 b = _mm512_div_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512((const void*)(h2 + k))), s2);
+		__m512 m = _mm512_min_ps(a, b);
+		acc = _mm256_add_ps(acc, _mm512_castps512_ps256(m));
+		acc = _mm256_add_ps(acc, _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(m), 1)));
+	}
+
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	__m128 t = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	return _mm_cvtss_f32(_mm_add_ss(t, _mm_shuffle_ps(t, t, 1)));
+}
+
+static const HistogramKernels kernels_avx2 = {
+	SIMD_LEVEL_AVX2, color_intersection_avx2, texture_intersection_avx2
+};
+
+// 24 texture bins do not fill a 512-bit loop, so AVX-512 keeps the AVX2 texture kernel.
+static const HistogramKernels kernels_avx512 = {
+	SIMD_LEVEL_AVX512, color_intersection_avx512, texture_intersection_avx2
+};
+#endif
+
+const HistogramKernels* histogram_kernels_for(SimdLevel level) {
+	if (level > simd_detect()) return NULL;
+
+	switch (level) {
+	case SIMD_LEVEL_SCALAR: return &kernels_scalar;
+#ifdef SIMD_SSE2
+	case SIMD_LEVEL_SSE2: return &kernels_sse2;
+#endif
+#ifdef SIMD_X86
+	case SIMD_LEVEL_AVX2: return &kernels_avx2;
+	case SIMD_LEVEL_AVX512: return &kernels_avx512;
+#endif
+	default: return NULL;
+	}
+}
+
+const HistogramKernels* histogram_kernels(void) {
+	static const HistogramKernels* best = NULL;
+	if (best == NULL) {
+		const HistogramKernels* k = NULL;
+		for (int level = simd_detect(); k == NULL && level >= SIMD_LEVEL_SCALAR; level--) {
+			k = histogram_kernels_for((SimdLevel)level);
+		}
+		best = k;
+	}
+	return best;
+}
@@ -0,0 +1,27 @@
+#ifndef __SIMILARITY_KERNELS_H__
+#define __SIMILARITY_KERNELS_H__
+
+#include "simd.h"
+
+/*
+Histogram intersection kernels for region similarity.
+color:   sum over 80 bins of min(h1 / size1, h2 / size2); bins 75-79 are zero padding.
+texture: sum over 3 channels x 8 bins of min(h1 / total1[c], h2 / total2[c]),
+         where a channel with a zero total counts as all zeros.
+
+Every level sums into 8 partial sums (lane j takes bins j, j + 8, j + 16, ...) and
+reduces them in the same fixed order, so all levels return bit-identical results.
+*/
+typedef struct {
+	SimdLevel level;
+	float (*color)(const int* h1, const int* h2, float size1, float size2);
+	float (*texture)(const float* h1, const float* h2, const float* total1, const float* total2);
+} HistogramKernels;
+
+// Kernels for the widest level the CPU supports.
+const HistogramKernels* histogram_kernels(void);
+
+// Kernels for one level, or NULL when that level is not available here.
+const HistogramKernels* histogram_kernels_for(SimdLevel level);
+
+#endif // !__SIMILARITY_KERNELS_H__
@@ -2,8 +2,27 @@
 #include "image.h"
 #include "utils.h"
 #include "selective_search.h"
+#include "image_process.h"
+#include "gaussian_blur.h"
+#include "matrix.h"
+#include "gbs.h"
+#include "disjoint_set.h"
+#include "texture.h"
+#include "color_convert.h"
+#include "similarity_kernels.h"
+#include "image_features.h"
+#include "region_stats.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 int image_load_test() {
 
@@ -70,4 +89,1582 @@ int pixel_distance_test() {
 
     return 1;
 
-}
\ No newline at end of file
+}
+
+int gaussian_blur_benchmark() {
+
+    printf("==========================================\n");
+    printf("============= Gaussian Blur ==============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    const int kernel_size = 5;
+    const float sigma = 2.0f;
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    Image matrix_img = copy_image(&base);
+    Image separable_img = copy_image(&base);
+
+    // Current path: 2D Matrix kernel, one patch Matrix per pixel.
+    clock_t start = clock();
+    Matrix gaussian = create_gaussian_kernel(kernel_size, sigma);
+    apply_kernel(&matrix_img, &gaussian);
+    free_matrix(&gaussian);
+    double matrix_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    // Separable path: horizontal + vertical pass over reused row buffers.
+    start = clock();
+    gaussian_blur(&separable_img, sigma, kernel_size);
+    double separable_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    // apply_kernel leaves the border unblurred, so only compare the interior.
+    int radius = kernel_size / 2;
+    int max_diff = 0;
+    for (int y = radius; y < base.height - radius; y++) {
+        for (int x = radius; x < base.width - radius; x++) {
+            Pixel a = matrix_img.pixels[y * base.width + x];
+            Pixel b = separable_img.pixels[y * base.width + x];
+            int d = abs(a.r - b.r);
+            if (abs(a.g - b.g) > d) d = abs(a.g - b.g);
+            if (abs(a.b - b.b) > d) d = abs(a.b - b.b);
+            if (d > max_diff) max_diff = d;
+        }
+    }
+
+    printf("Image: %s (%d x %d), kernel %d, sigma %.1f\n", file, base.width, base.height, kernel_size, sigma);
+    printf("apply_kernel:  %.2f ms\n", matrix_ms);
+    printf("gaussian_blur: %.2f ms (x%.1f)\n", separable_ms, separable_ms > 0 ? matrix_ms / separable_ms : 0.0);
+    printf("Max interior difference: %d\n", max_diff);
+
+    free_image(&base);
+    free_image(&matrix_img);
+    free_image(&separable_img);
+
+    // Truncation to int may flip the last bit between the two summation orders.
+    int success = max_diff <= 1;
+
+    printf("\n");
+    if (success) printf("=============== Test Passed ==============\n");
+    else printf("=============== Test Failed ==============\n");
+    printf("==========================================\n");
+
+    return success;
+}
+
+
+int gbs_tiled_test() {
+
+    printf("==========================================\n");
+    printf("============== Tiled GBS =================\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    const float k = 500.0f;
+    const float sigma = 2.0f;
+    const int tile_sizes[] = { 0, 37, 128 };  // 0: one GBS_TILE_SIZE tile covers the image
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    int width = base.width, height = base.height;
+    int pixel_count = width * height;
+    DisjointSet serial_ds;
+
+    double start = omp_get_wtime();
+    int serial_merged = graph_based_segmentation(&serial_ds, &base, k, sigma, GBS_MIN_REGION_SIZE);
+    double serial_ms = 1000.0 * (omp_get_wtime() - start);
+
+    int serial_regions = 0;
+    for (int i = 0; i < pixel_count; i++) {
+        if (ds_find(&serial_ds, i) == i) serial_regions++;
+    }
+
+    printf("Image: %s (%d x %d), %d threads\n", file, width, height, omp_get_max_threads());
+    printf("Serial:         %.2f ms, %d regions\n", serial_ms, serial_regions);
+
+    // The tile lists are merged into the serial edge order, so every tile size must agree exactly.
+    int ok = 1;
+    for (int i = 0; i < (int)(sizeof(tile_sizes) / sizeof(tile_sizes[0])); i++) {
+        DisjointSet tiled_ds;
+        start = omp_get_wtime();
+        int tiled_merged = graph_based_segmentation_tiled(&tiled_ds, &base, k, sigma, GBS_MIN_REGION_SIZE, tile_sizes[i]);
+        double tiled_ms = 1000.0 * (omp_get_wtime() - start);
+
+        int tiled_regions = 0;
+        for (int p = 0; p < pixel_count; p++) {
+            if (ds_find(&tiled_ds, p) == p) tiled_regions++;
+        }
+        int drift = gbs_label_drift(&serial_ds, &tiled_ds);
+        if (drift != 0 || tiled_regions != serial_regions || tiled_merged != serial_merged) ok = 0;
+
+        printf("Tiles of %4d:  %.2f ms, %d regions, label drift %d pixels\n",
+            tile_sizes[i] > 0 ? tile_sizes[i] : GBS_TILE_SIZE, tiled_ms, tiled_regions, drift);
+        ds_free(&tiled_ds);
+    }
+
+    ds_free(&serial_ds);
+    free_image(&base);
+
+    printf("\n");
+    if (!ok) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+// Compares box coordinates only, for references that do not score their boxes.
+static int same_box_geometry(const BoundingBox* a, const BoundingBox* b) {
+    return a->min_x == b->min_x && a->min_y == b->min_y && a->max_x == b->max_x && a->max_y == b->max_y;
+}
+
+// The merge loop as it was before the similarity heap: a linear scan for the best pair per merge.
+static void linear_selective_search_merge(RegionList* rl, DisjointSet* ds, BoundingBoxList* bbl, float min_size_factor) {
+    SimilarityList sl;
+    init_similarity_list(&sl, rl->count);
+    calculate_similarity(rl, &sl);
+
+    int active_regions = count_active_regions(rl);
+    while (sl.count > 0 && active_regions > 1) {
+        Similarity* best_sim = get_best_similarity(&sl, rl, min_size_factor);
+        if (!best_sim) break;
+
+        int r_idx1 = best_sim->region_idx1;
+        int r_idx2 = best_sim->region_idx2;
+
+        RegionBounds merged = rl_merged_bounds(rl, r_idx1, r_idx2);
+        BoundingBox box = { merged.min_x, merged.min_y, merged.max_x, merged.max_y, 0.0f };
+        add_bbox(bbl, box);
+
+        ds_union(ds, rl->id[r_idx1], rl->id[r_idx2]);
+        int keep_idx = min(r_idx1, r_idx2);
+        remove_similarity_entries(&sl, r_idx1, r_idx2);
+        rl_merge_regions(rl, r_idx1, r_idx2);
+
+        NeighborSet* ns = &rl->neighbors[keep_idx];
+        for (int n = 0; n < ns->count; n++) add_similarity(rl, &sl, keep_idx, ns->items[n]);
+        active_regions--;
+    }
+    sl_free(&sl);
+}
+
+int similarity_heap_test() {
+
+    printf("==========================================\n");
+    printf("=========== Similarity Heap ==============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    Image gbs_img = copy_image(&base);
+    DisjointSet linear_ds, heap_ds;
+    graph_based_segmentation(&linear_ds, &gbs_img, 500.0f, 2.0f, 0);
+    ds_init(&heap_ds, linear_ds.count);
+    memcpy(heap_ds.nodes, linear_ds.nodes, sizeof(DSNode) * linear_ds.count);
+
+    RegionList linear_rl = create_regions(&base, &linear_ds);
+    RegionList heap_rl = create_regions(&base, &heap_ds);
+    printf("Regions: %d\n", count_active_regions(&linear_rl));
+
+    BoundingBoxList linear_boxes, heap_boxes;
+    init_bbox_list(&linear_boxes);
+    init_bbox_list(&heap_boxes);
+
+    clock_t start = clock();
+    linear_selective_search_merge(&linear_rl, &linear_ds, &linear_boxes, 2.0f);
+    double linear_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    selective_search_merge(&heap_rl, &heap_ds, &heap_boxes, linear_rl.count, 2.0f);
+    double heap_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    // Both loops have to produce the same merges in the same order.
+    int mismatch = (linear_boxes.count != heap_boxes.count) ? 1 : 0;
+    for (int i = 0; !mismatch && i < heap_boxes.count; i++) {
+        if (!same_box_geometry(&linear_boxes.boxes[i], &heap_boxes.boxes[i])) {
+            printf("First differing merge: %d\n", i);
+            mismatch = 1;
+        }
+    }
+
+    printf("Linear scan: %.2f ms, %d merges\n", linear_ms, linear_boxes.count);
+    printf("Heap:        %.2f ms, %d merges\n", heap_ms, heap_boxes.count);
+
+    free_bbox_list(&linear_boxes);
+    free_bbox_list(&heap_boxes);
+    rl_free(&linear_rl);
+    rl_free(&heap_rl);
+    ds_free(&linear_ds);
+    ds_free(&heap_ds);
+    free_image(&gbs_img);
+    free_image(&base);
+
+    printf("\n");
+    if (mismatch) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+int texture_bin_test() {
+
+    printf("==========================================\n");
+    printf("============= Texture Bins ===============\n");
+    printf("\n");
+
+    // The bin selection has to match the atan2 formula it replaces for every 8-bit gradient.
+    int bin_mismatch = 0;
+    for (int gx = -255; gx <= 255; gx++) {
+        for (int gy = -255; gy <= 255; gy++) {
+            float ori = atan2f((float)gy, (float)gx) + M_PI;
+            int expected = (int)(ori / (2 * M_PI) * 8.0f) % 8;
+            if (texture_bin(gx, gy) != expected) bin_mismatch++;
+        }
+    }
+    printf("texture_bin mismatches: %d / %d\n", bin_mismatch, 511 * 511);
+
+    // The vectorized row kernel against the per-element definition, on random rows.
+    const int width = 257;
+    const int n = 3 * width;
+    unsigned char* rows = malloc(3 * n);
+    float* mag = malloc(sizeof(float) * n);
+    unsigned char* bin = malloc(n);
+    int row_mismatch = 0;
+
+    srand(7);
+    for (int trial = 0; trial < 200; trial++) {
+        for (int i = 0; i < 3 * n; i++) rows[i] = (unsigned char)(rand() & 0xFF);
+        // Include flat and saturated runs so the axis and diagonal cases are exercised.
+        for (int i = 0; i < n / 4; i++) rows[n + i] = rows[i] = rows[2 * n + i] = (unsigned char)((trial & 1) ? 0 : 255);
+
+        texture_gradient_row(rows, rows + n, rows + 2 * n, width, mag, bin);
+
+        for (int i = 0; i < n; i++) {
+            int left = (i >= 3) ? i - 3 : i;
+            int right = (i + 3 < n) ? i + 3 : i;
+            int gx = rows[n + right] - rows[n + left];
+            int gy = rows[2 * n + i] - rows[i];
+            if (mag[i] != sqrtf((float)(gx * gx + gy * gy)) || bin[i] != texture_bin(gx, gy)) row_mismatch++;
+        }
+    }
+    printf("texture_gradient_row mismatches: %d\n", row_mismatch);
+
+    free(rows);
+    free(mag);
+    free(bin);
+
+    printf("\n");
+    if (bin_mismatch != 0 || row_mismatch != 0) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+int color_convert_test() {
+
+    printf("==========================================\n");
+    printf("============ Color Convert ===============\n");
+    printf("\n");
+
+    // Every 8-bit RGB value, one row of 256 blues at a time.
+    Pixel src[256], dst[256];
+    int lab_off = 0, lab_bad = 0, hsv_off = 0, hsv_bad = 0;
+    double lab_ms = 0.0, hsv_ms = 0.0, ref_ms = 0.0;
+
+    color_convert_init();
+    for (int r = 0; r < 256; r++) {
+        for (int g = 0; g < 256; g++) {
+            for (int b = 0; b < 256; b++) {
+                src[b].r = r; src[b].g = g; src[b].b = b;
+            }
+
+            clock_t start = clock();
+            rgb_row_to_lab(src, dst, 256);
+            lab_ms += 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+            start = clock();
+            Pixel ref[256];
+            for (int b = 0; b < 256; b++) {
+                Lab lab = rgb_to_lab(src[b]);
+                ref[b].r = (int)(lab.l * 2.55f);
+                ref[b].g = (int)(lab.a + 128.0f);
+                ref[b].b = (int)(lab.b + 128.0f);
+            }
+            ref_ms += 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+            for (int b = 0; b < 256; b++) {
+                int d = max(abs(dst[b].r - ref[b].r), max(abs(dst[b].g - ref[b].g), abs(dst[b].b - ref[b].b)));
+                if (d == 1) lab_off++;
+                if (d > 1) lab_bad++;
+            }
+
+            start = clock();
+            rgb_row_to_hsv(src, dst, 256);
+            hsv_ms += 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+            for (int b = 0; b < 256; b++) {
+                HSV hsv = rgb_to_hsv(src[b]);
+                Pixel expected;
+                expected.r = (int)(hsv.h / 360.0f * 255.0f);
+                expected.g = (int)(hsv.s * 255.0f);
+                expected.b = (int)(hsv.v * 255.0f);
+
+                int d = max(abs(dst[b].r - expected.r), max(abs(dst[b].g - expected.g), abs(dst[b].b - expected.b)));
+                if (d == 1) hsv_off++;
+                if (d > 1) hsv_bad++;
+            }
+        }
+    }
+
+    printf("Lab: %d colors off by 1, %d off by more (%.1f ms, reference %.1f ms)\n", lab_off, lab_bad, lab_ms, ref_ms);
+    printf("HSV: %d colors off by 1, %d off by more (%.1f ms)\n", hsv_off, hsv_bad, hsv_ms);
+
+    printf("\n");
+    if (lab_bad != 0 || hsv_bad != 0) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+// Color and texture intersection as they were computed before the kernels: one fminf per bin, summed in order.
+static float sequential_intersection(const RegionList* rl, int i, int j) {
+    const int* c1 = rl->color_counts + (size_t)i * COLOR_HIST_STRIDE;
+    const int* c2 = rl->color_counts + (size_t)j * COLOR_HIST_STRIDE;
+    float color = 0.0f;
+    for (int k = 0; k < COLOR_HIST_SIZE; k++) {
+        color += fminf((float)c1[k] / rl->size[i], (float)c2[k] / rl->size[j]);
+    }
+
+    const float* t1 = rl->texture_raw + (size_t)i * TEXTURE_HIST_STRIDE;
+    const float* t2 = rl->texture_raw + (size_t)j * TEXTURE_HIST_STRIDE;
+    const float* total1 = rl->texture_total + (size_t)i * 4;
+    const float* total2 = rl->texture_total + (size_t)j * 4;
+    float texture = 0.0f;
+    for (int k = 0; k < TEXTURE_HIST_SIZE; k++) {
+        int c = k / TEXTURE_BINS;
+        texture += fminf(total1[c] > 0 ? t1[k] / total1[c] : 0, total2[c] > 0 ? t2[k] / total2[c] : 0);
+    }
+    return color + texture;
+}
+
+int similarity_kernel_benchmark() {
+
+    printf("==========================================\n");
+    printf("========= Similarity Kernels =============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    const int repeats = 50;
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    Image gbs_img = copy_image(&base);
+    DisjointSet ds;
+    graph_based_segmentation(&ds, &gbs_img, 50.0f, 0.5f, 0);
+    RegionList rl = create_regions(&base, &ds);
+
+    int pair_count = 0;
+    for (int i = 0; i < rl.count; i++) pair_count += rl.neighbors[i].count;
+    int* pairs = malloc(sizeof(int) * pair_count);
+    pair_count = 0;
+    for (int i = 0; i < rl.count; i++) {
+        for (int n = 0; n < rl.neighbors[i].count; n++) {
+            int j = rl.neighbors[i].items[n];
+            if (j > i) { pairs[2 * pair_count] = i; pairs[2 * pair_count + 1] = j; pair_count++; }
+        }
+    }
+    printf("Regions: %d, adjacent pairs: %d, %d passes\n", rl.count, pair_count, repeats);
+
+    float* reference = malloc(sizeof(float) * pair_count);
+    float* result = malloc(sizeof(float) * pair_count);
+    float* scalar_result = malloc(sizeof(float) * pair_count);
+    volatile float sink = 0.0f;
+
+    clock_t start = clock();
+    for (int r = 0; r < repeats; r++) {
+        for (int p = 0; p < pair_count; p++) reference[p] = sequential_intersection(&rl, pairs[2 * p], pairs[2 * p + 1]);
+        sink += reference[0];
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%-10s %8.2f M pairs/s\n", "before", repeats * pair_count / seconds / 1e6);
+
+    int mismatch = 0;
+    for (int level = SIMD_LEVEL_SCALAR; level <= SIMD_LEVEL_AVX512; level++) {
+        const HistogramKernels* k = histogram_kernels_for((SimdLevel)level);
+        if (k == NULL) continue;
+
+        start = clock();
+        for (int r = 0; r < repeats; r++) {
+            for (int p = 0; p < pair_count; p++) {
+                int i = pairs[2 * p], j = pairs[2 * p + 1];
+                result[p] =
+                    k->color(rl.color_counts + (size_t)i * COLOR_HIST_STRIDE, rl.color_counts + (size_t)j * COLOR_HIST_STRIDE,
+                        (float)rl.size[i], (float)rl.size[j]) +
+                    k->texture(rl.texture_raw + (size_t)i * TEXTURE_HIST_STRIDE, rl.texture_raw + (size_t)j * TEXTURE_HIST_STRIDE,
+                        rl.texture_total + (size_t)i * 4, rl.texture_total + (size_t)j * 4);
+            }
+            sink += result[0];
+        }
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        // Every level has to agree bit for bit; against the old in-order sum only rounding differs.
+        float max_diff = 0.0f;
+        for (int p = 0; p < pair_count; p++) {
+            max_diff = fmaxf(max_diff, fabsf(result[p] - reference[p]));
+            if (level == SIMD_LEVEL_SCALAR) scalar_result[p] = result[p];
+            else if (result[p] != scalar_result[p]) mismatch++;
+        }
+        printf("%-10s %8.2f M pairs/s, max diff to before %g\n", simd_level_name((SimdLevel)level), repeats * pair_count / seconds / 1e6, max_diff);
+    }
+    printf("Results differing from the scalar kernels: %d\n", mismatch);
+
+    free(reference);
+    free(result);
+    free(scalar_result);
+    free(pairs);
+    rl_free(&rl);
+    ds_free(&ds);
+    free_image(&gbs_img);
+    free_image(&base);
+
+    printf("\n");
+    if (mismatch) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+int strategy_set_test() {
+
+    printf("==========================================\n");
+    printf("============= Strategy Set ===============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    SelectiveSearchStrategy strategies[] = {
+        { COLOR_SPACE_RGB, 500.0f, 2.0f, default_similarity_weights(), GBS_MIN_REGION_SIZE, unlimited_proposal_budget() },
+        { COLOR_SPACE_LAB_L_CHANNEL, 500.0f, 2.0f, default_similarity_weights(), GBS_MIN_REGION_SIZE, unlimited_proposal_budget() },
+        { COLOR_SPACE_RGB, 200.0f, 1.0f, default_similarity_weights(), GBS_MIN_REGION_SIZE, unlimited_proposal_budget() },
+        { COLOR_SPACE_LAB_L_CHANNEL, 200.0f, 2.0f, default_similarity_weights(), GBS_MIN_REGION_SIZE, unlimited_proposal_budget() },
+    };
+    int count = sizeof(strategies) / sizeof(strategies[0]);
+
+    // One strategy after the other, as main.c used to do it.
+    double start = omp_get_wtime();
+    BoundingBoxList serial;
+    init_bbox_list(&serial);
+    double slowest = 0.0;
+    for (int i = 0; i < count; i++) {
+        double t = omp_get_wtime();
+        BoundingBoxList one = run_selective_search_strategy(&base, &strategies[i], 2.0f);
+        t = omp_get_wtime() - t;
+        if (t > slowest) slowest = t;
+        for (int j = 0; j < one.count; j++) add_bbox(&serial, one.boxes[j]);
+        free_bbox_list(&one);
+    }
+    double serial_s = omp_get_wtime() - start;
+
+    start = omp_get_wtime();
+    BoundingBoxList parallel = run_selective_search_strategies(&base, strategies, count, 2.0f);
+    double parallel_s = omp_get_wtime() - start;
+
+    int mismatch = (serial.count != parallel.count) ? 1 : 0;
+    for (int i = 0; !mismatch && i < serial.count; i++) {
+        if (memcmp(&serial.boxes[i], &parallel.boxes[i], sizeof(BoundingBox)) != 0) mismatch = 1;
+    }
+
+    printf("\n%d strategies, %d threads, %d proposals\n", count, omp_get_max_threads(), parallel.count);
+    printf("Serial:   %.1f ms (slowest strategy %.1f ms)\n", 1000.0 * serial_s, 1000.0 * slowest);
+    printf("Parallel: %.1f ms\n", 1000.0 * parallel_s);
+
+    free_bbox_list(&serial);
+    free_bbox_list(&parallel);
+    free_image(&base);
+
+    printf("\n");
+    if (mismatch) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+int image_features_test() {
+
+    printf("==========================================\n");
+    printf("============= Image Features =============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    ImageFeatures features;
+    image_features_init(&features, &base);
+
+    int ok = 1;
+
+    // Every product is computed once and handed out again on later calls.
+    const CompactEdgeList* rgb_edges = image_features_edges(&features, COLOR_SPACE_RGB, 2.0f);
+    if (image_features_edges(&features, COLOR_SPACE_RGB, 2.0f) != rgb_edges) ok = 0;
+    if (image_features_edges(&features, COLOR_SPACE_RGB, 1.0f) == rgb_edges) ok = 0;
+    const CompactEdgeList* lab_edges = image_features_edges(&features, COLOR_SPACE_LAB_L_CHANNEL, 2.0f);
+    if (image_features_edges(&features, COLOR_SPACE_LAB_L_CHANNEL, 1.0f) != lab_edges) ok = 0;
+    if (image_features_color(&features, COLOR_SPACE_RGB)->pixels != base.pixels) ok = 0;
+    const TextureGradients* grads = image_features_gradients(&features, COLOR_SPACE_LAB_L_CHANNEL);
+    if (image_features_gradients(&features, COLOR_SPACE_LAB_L_CHANNEL) != grads) ok = 0;
+    printf("Products reused: %s\n", ok ? "yes" : "no");
+
+    // Strategies that only differ in k or weights, with and without the shared products.
+    SimilarityWeights color_only = { 1.0f, 0.0f, 1.0f, 1.0f };
+    SelectiveSearchStrategy strategies[] = {
+        { COLOR_SPACE_RGB, 500.0f, 2.0f, default_similarity_weights(), GBS_MIN_REGION_SIZE, unlimited_proposal_budget() },
+        { COLOR_SPACE_RGB, 300.0f, 2.0f, default_similarity_weights(), GBS_MIN_REGION_SIZE, unlimited_proposal_budget() },
+        { COLOR_SPACE_RGB, 500.0f, 2.0f, color_only, GBS_MIN_REGION_SIZE, unlimited_proposal_budget() },
+        { COLOR_SPACE_LAB_L_CHANNEL, 500.0f, 2.0f, default_similarity_weights(), GBS_MIN_REGION_SIZE, unlimited_proposal_budget() },
+        { COLOR_SPACE_LAB_L_CHANNEL, 300.0f, 2.0f, default_similarity_weights(), GBS_MIN_REGION_SIZE, unlimited_proposal_budget() },
+        { COLOR_SPACE_LAB_L_CHANNEL, 500.0f, 2.0f, color_only, GBS_MIN_REGION_SIZE, unlimited_proposal_budget() },
+    };
+    int count = sizeof(strategies) / sizeof(strategies[0]);
+    for (int i = 0; i < count; i++) image_features_expect(&features, strategies[i].color_space);
+
+    // A colour space with a single strategy never materializes its gradient planes.
+    ImageFeatures single;
+    image_features_init(&single, &base);
+    image_features_expect(&single, COLOR_SPACE_RGB);
+    BoundingBoxList single_boxes = run_selective_search_strategy_cached(&single, &strategies[0], 2.0f);
+    int gradients_skipped = !single.gradients_ready[COLOR_SPACE_RGB];
+    printf("Gradients skipped for a single strategy: %s\n", gradients_skipped ? "yes" : "no");
+    if (!gradients_skipped) ok = 0;
+    free_bbox_list(&single_boxes);
+    image_features_free(&single);
+
+    double fresh_s = 0.0, shared_s = 0.0;
+    for (int i = 0; ok && i < count; i++) {
+        double t = omp_get_wtime();
+        BoundingBoxList fresh = run_selective_search_strategy(&base, &strategies[i], 2.0f);
+        fresh_s += omp_get_wtime() - t;
+
+        t = omp_get_wtime();
+        BoundingBoxList shared = run_selective_search_strategy_cached(&features, &strategies[i], 2.0f);
+        shared_s += omp_get_wtime() - t;
+
+        if (fresh.count != shared.count) ok = 0;
+        for (int j = 0; ok && j < fresh.count; j++) {
+            if (memcmp(&fresh.boxes[j], &shared.boxes[j], sizeof(BoundingBox)) != 0) ok = 0;
+        }
+        free_bbox_list(&fresh);
+        free_bbox_list(&shared);
+    }
+
+    printf("\n%d strategies\n", count);
+    printf("Fresh features:  %.1f ms\n", 1000.0 * fresh_s);
+    printf("Shared features: %.1f ms\n", 1000.0 * shared_s);
+
+    image_features_free(&features);
+    free_image(&base);
+
+    printf("\n");
+    if (!ok) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+int gbs_k_sweep_test() {
+
+    printf("==========================================\n");
+    printf("=============== GBS k Sweep ==============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    const float sigma = 2.0f;
+    const float ks[5] = { 100.0f, 200.0f, 300.0f, 500.0f, 800.0f };
+    const int k_count = sizeof(ks) / sizeof(ks[0]);
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    int pixel_count = base.width * base.height;
+    DisjointSet single[5], sweep[5];
+
+    // One full graph_based_segmentation per k.
+    double start = omp_get_wtime();
+    for (int i = 0; i < k_count; i++) {
+        Image img = copy_image(&base);
+        graph_based_segmentation(&single[i], &img, ks[i], sigma, GBS_MIN_REGION_SIZE);
+        free_image(&img);
+    }
+    double single_s = omp_get_wtime() - start;
+
+    start = omp_get_wtime();
+    Image img = copy_image(&base);
+    graph_based_segmentation_sweep(sweep, &img, ks, k_count, sigma, GBS_MIN_REGION_SIZE);
+    free_image(&img);
+    double sweep_s = omp_get_wtime() - start;
+
+    int drift = 0;
+    for (int i = 0; i < k_count; i++) {
+        int regions = 0;
+        for (int p = 0; p < pixel_count; p++) {
+            if (ds_find(&sweep[i], p) == p) regions++;
+        }
+        int d = gbs_label_drift(&single[i], &sweep[i]);
+        drift += d;
+        printf("k = %5.1f: %6d regions, drift %d\n", ks[i], regions, d);
+    }
+
+    printf("\n%d values of k, %d threads\n", k_count, omp_get_max_threads());
+    printf("One segmentation per k: %.1f ms\n", 1000.0 * single_s);
+    printf("Shared sorted edges:    %.1f ms\n", 1000.0 * sweep_s);
+
+    for (int i = 0; i < k_count; i++) {
+        ds_free(&single[i]);
+        ds_free(&sweep[i]);
+    }
+    free_image(&base);
+
+    printf("\n");
+    if (drift != 0) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+int min_region_size_test() {
+
+    printf("==========================================\n");
+    printf("============ Min Region Size =============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    const float k = 500.0f;
+    const float sigma = 2.0f;
+    const int min_size = GBS_MIN_REGION_SIZE;
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    int pixel_count = base.width * base.height;
+    Image raw_img = copy_image(&base);
+    Image min_img = copy_image(&base);
+    DisjointSet raw_ds, min_ds;
+
+    graph_based_segmentation(&raw_ds, &raw_img, k, sigma, 0);
+    clock_t start = clock();
+    int merged = graph_based_segmentation(&min_ds, &min_img, k, sigma, min_size);
+    double min_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    int raw_regions = 0, min_regions = 0, raw_small = 0, min_small = 0;
+    for (int i = 0; i < pixel_count; i++) {
+        if (ds_find(&raw_ds, i) == i) {
+            raw_regions++;
+            if (raw_ds.nodes[i].size < min_size) raw_small++;
+        }
+        if (ds_find(&min_ds, i) == i) {
+            min_regions++;
+            if (min_ds.nodes[i].size < min_size) min_small++;
+        }
+    }
+
+    printf("Image: %s (%d x %d), k %.1f, min size %d\n", file, base.width, base.height, k, min_size);
+    printf("Without pass: %d regions, %d smaller than min size\n", raw_regions, raw_small);
+    printf("With pass:    %d regions, %d smaller than min size (%.2f ms)\n", min_regions, min_small, min_ms);
+
+    // The pass only joins components, and every small one finds a neighbour unless the image is one region.
+    int ok = (min_small == 0 || min_regions == 1) && raw_regions - merged == min_regions && min_regions <= raw_regions;
+
+    ds_free(&raw_ds);
+    ds_free(&min_ds);
+    free_image(&base);
+    free_image(&raw_img);
+    free_image(&min_img);
+
+    printf("\n");
+    if (!ok) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+int fused_blur_edges_test() {
+
+    printf("==========================================\n");
+    printf("=========== Fused Blur + Edges ===========\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    const float sigma = 2.0f;
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    // pixel_distance now takes sqrtf of the exact integer square; check every square that can occur.
+    int distance_mismatch = 0;
+    for (int sq = 0; sq <= 3 * 255 * 255; sq++) {
+        if (sqrtf((float)sq) != (float)sqrt((double)sq)) distance_mismatch++;
+    }
+
+    // Two passes: blur a copy of the image, then build the edges from it.
+    clock_t start = clock();
+    Image blurred = copy_image(&base);
+    gaussian_blur(&blurred, sigma, GBS_BLUR_KERNEL_SIZE);
+    CompactEdgeList two_pass;
+    build_compact_edges(&blurred, &two_pass);
+    free_image(&blurred);
+    double two_pass_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    CompactEdgeList fused;
+    build_compact_edges_blurred(&base, sigma, &fused);
+    double fused_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    int edge_mismatch = (two_pass.size != fused.size) ? 1 : 0;
+    for (int i = 0; !edge_mismatch && i < fused.size; i++) {
+        if (two_pass.code[i] != fused.code[i] || two_pass.weight[i] != fused.weight[i]) edge_mismatch++;
+    }
+
+    size_t plane_bytes = sizeof(Pixel) * (size_t)base.width * base.height;
+    printf("Image: %s (%d x %d), sigma %.1f, %d edges\n", file, base.width, base.height, sigma, fused.size);
+    printf("Blur, then edges: %.2f ms, %zu bytes of blurred copy\n", two_pass_ms, plane_bytes);
+    printf("Fused:            %.2f ms, %zu bytes of blurred rows\n", fused_ms, 2 * sizeof(Pixel) * (size_t)base.width);
+    printf("Distance mismatches: %d, edge mismatches: %d\n", distance_mismatch, edge_mismatch);
+
+    free_compact_edges(&two_pass);
+    free_compact_edges(&fused);
+    free_image(&base);
+
+    printf("\n");
+    if (distance_mismatch != 0 || edge_mismatch != 0) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+// build_compact_edges as it was before the row kernels: one pixel_distance per edge.
+static void scalar_compact_edges(Image* img, CompactEdgeList* edges) {
+    int width = img->width;
+    int height = img->height;
+
+    init_compact_edges(edges, width, compact_edge_count(width, height));
+    for (int y = 0; y < height; y++) {
+        const Pixel* row = &img->pixels[y * width];
+        const Pixel* next = (y + 1 < height) ? row + width : NULL;
+        for (int x = 0; x < width; x++) {
+            int idx = y * width + x;
+            if (x + 1 < width) add_compact_edge(edges, idx, EDGE_DIR_E, pixel_distance(row[x], row[x + 1]));
+            if (next == NULL) continue;
+            if (x > 0) add_compact_edge(edges, idx, EDGE_DIR_SW, pixel_distance(row[x], next[x - 1]));
+            add_compact_edge(edges, idx, EDGE_DIR_S, pixel_distance(row[x], next[x]));
+            if (x + 1 < width) add_compact_edge(edges, idx, EDGE_DIR_SE, pixel_distance(row[x], next[x + 1]));
+        }
+    }
+}
+
+int edge_weight_kernel_test() {
+
+    printf("==========================================\n");
+    printf("========== Edge Weight Kernel ============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    const int repeats = 20;
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    // Random rows of every length up to 100, so each SIMD tail is exercised.
+    int value_mismatch = 0;
+    Pixel a[100], b[100];
+    uint32_t sq[100];
+    uint16_t weights[100];
+    srand(20);
+    for (int count = 0; count <= 100; count++) {
+        for (int i = 0; i < count; i++) {
+            a[i].r = rand() & 255; a[i].g = rand() & 255; a[i].b = rand() & 255;
+            b[i].r = rand() & 255; b[i].g = rand() & 255; b[i].b = rand() & 255;
+        }
+        // Extreme pairs at both ends of the range.
+        if (count > 1) { a[0].r = a[0].g = a[0].b = 0; b[0].r = b[0].g = b[0].b = 255; b[1] = a[1]; }
+
+        edge_distance_sq_row(a, b, count, sq);
+        edge_weight_row(a, b, count, weights);
+        for (int i = 0; i < count; i++) {
+            int dr = a[i].r - b[i].r, dg = a[i].g - b[i].g, db = a[i].b - b[i].b;
+            if (sq[i] != (uint32_t)(dr * dr + dg * dg + db * db)) value_mismatch++;
+            if (weights[i] != gbs_quantize_weight(pixel_distance(a[i], b[i]))) value_mismatch++;
+        }
+    }
+
+    // The squared distance is a sort key: the quantized weight never decreases as it grows.
+    int order_mismatch = 0;
+    uint16_t previous = 0;
+    for (int s = 0; s <= 3 * 255 * 255; s++) {
+        uint16_t q = gbs_quantize_weight(sqrtf((float)s));
+        if (q < previous) order_mismatch++;
+        previous = q;
+    }
+
+    // Whole image: same edges, and the same order once sorted.
+    CompactEdgeList reference, kernel;
+    clock_t start = clock();
+    for (int r = 0; r < repeats; r++) {
+        if (r > 0) free_compact_edges(&reference);
+        scalar_compact_edges(&base, &reference);
+    }
+    double scalar_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC / repeats;
+
+    start = clock();
+    for (int r = 0; r < repeats; r++) {
+        if (r > 0) free_compact_edges(&kernel);
+        build_compact_edges(&base, &kernel);
+    }
+    double kernel_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC / repeats;
+
+    int edge_mismatch = (reference.size != kernel.size) ? 1 : 0;
+    for (int i = 0; !edge_mismatch && i < kernel.size; i++) {
+        if (reference.code[i] != kernel.code[i] || reference.weight[i] != kernel.weight[i]) edge_mismatch++;
+    }
+    sort_compact_edges(&reference);
+    sort_compact_edges(&kernel);
+    for (int i = 0; !edge_mismatch && i < kernel.size; i++) {
+        if (reference.code[i] != kernel.code[i]) order_mismatch++;
+    }
+
+    printf("Image: %s (%d x %d), %d edges\n", file, base.width, base.height, kernel.size);
+    printf("pixel_distance per edge: %.2f ms\n", scalar_ms);
+    printf("Row kernels:             %.2f ms\n", kernel_ms);
+    printf("Value mismatches: %d, edge mismatches: %d, order mismatches: %d\n", value_mismatch, edge_mismatch, order_mismatch);
+
+    free_compact_edges(&reference);
+    free_compact_edges(&kernel);
+    free_image(&base);
+
+    printf("\n");
+    if (value_mismatch != 0 || edge_mismatch != 0 || order_mismatch != 0) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+int gbs_buckets_test() {
+
+    printf("==========================================\n");
+    printf("============ Bucket Queue GBS ============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    const float k = 500.0f;
+    const float sigma = 2.0f;
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    int pixel_count = base.width * base.height;
+    int drift = 0;
+
+    // With and without the small-component pass.
+    const int min_sizes[2] = { 0, GBS_MIN_REGION_SIZE };
+    for (int m = 0; m < 2; m++) {
+        DisjointSet sorted_ds, bucket_ds;
+
+        clock_t start = clock();
+        int sorted_merged = graph_based_segmentation(&sorted_ds, &base, k, sigma, min_sizes[m]);
+        double sorted_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        int bucket_merged = graph_based_segmentation_buckets(&bucket_ds, &base, k, sigma, min_sizes[m]);
+        double bucket_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+        int d = gbs_label_drift(&sorted_ds, &bucket_ds);
+        if (sorted_merged != bucket_merged) d++;
+        drift += d;
+
+        printf("min size %2d: sorted %.2f ms, buckets %.2f ms, drift %d\n", min_sizes[m], sorted_ms, bucket_ms, d);
+
+        ds_free(&sorted_ds);
+        ds_free(&bucket_ds);
+    }
+
+    // Edge scratch: the compact list with its sort buffer, against the codes and bucket table.
+    double edges = compact_edge_count(base.width, base.height);
+    double buckets = gbs_quantize_weight(GBS_MAX_WEIGHT_RGB) + 2;
+    printf("\nEdge scratch per pixel: sorted %.1f bytes, buckets %.1f bytes\n",
+        edges * 2 * (sizeof(uint32_t) + sizeof(uint16_t)) / pixel_count,
+        (edges * sizeof(uint32_t) + buckets * sizeof(size_t)) / pixel_count);
+
+    free_image(&base);
+
+    printf("\n");
+    if (drift != 0) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+typedef struct {
+    BandRegion* items;
+    int count;
+    int capacity;
+} BandRegionList;
+
+static void collect_band_region(void* ctx, const BandRegion* region) {
+    BandRegionList* list = (BandRegionList*)ctx;
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 256;
+        list->items = realloc(list->items, sizeof(BandRegion) * list->capacity);
+    }
+    list->items[list->count++] = *region;
+}
+
+static int compare_band_region(const void* p, const void* q) {
+    const BandRegion* a = (const BandRegion*)p;
+    const BandRegion* b = (const BandRegion*)q;
+    if (a->bounds.min_y != b->bounds.min_y) return a->bounds.min_y - b->bounds.min_y;
+    if (a->bounds.min_x != b->bounds.min_x) return a->bounds.min_x - b->bounds.min_x;
+    if (a->bounds.max_y != b->bounds.max_y) return a->bounds.max_y - b->bounds.max_y;
+    if (a->bounds.max_x != b->bounds.max_x) return a->bounds.max_x - b->bounds.max_x;
+    return a->size - b->size;
+}
+
+// Same region, ignoring the label, which depends on when the region was finished.
+static int same_band_region(const BandRegion* a, const BandRegion* b) {
+    return a->size == b->size && a->sum_r == b->sum_r && a->sum_g == b->sum_g && a->sum_b == b->sum_b
+        && memcmp(&a->bounds, &b->bounds, sizeof(RegionBounds)) == 0;
+}
+
+int band_stream_test() {
+
+    printf("==========================================\n");
+    printf("========== Band Streaming GBS ============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    const char* bmp_file = "band_stream_test.bmp";
+    const float k = 500.0f;
+    const float sigma = 2.0f;
+    const int band_height = 32;
+    const int lookahead = GBS_BAND_LOOKAHEAD;
+    const double max_drift_ratio = 0.1;
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    int width = base.width, height = base.height;
+    int ok = 1;
+
+    // Reference: the whole image at once, with the same statistics per component.
+    DisjointSet ds;
+    graph_based_segmentation(&ds, &base, k, sigma, 0);
+    int* labels = malloc(sizeof(int) * width * height);
+    int reference_count = ds_flatten(&ds, labels);
+    BandRegionList reference = { 0 };
+    reference.items = malloc(sizeof(BandRegion) * reference_count);
+    reference.count = reference.capacity = reference_count;
+    for (int i = 0; i < reference_count; i++) {
+        memset(&reference.items[i], 0, sizeof(BandRegion));
+        reference.items[i].bounds.min_x = reference.items[i].bounds.min_y = 0x7fffffff;
+        reference.items[i].bounds.max_x = reference.items[i].bounds.max_y = -1;
+    }
+    for (int p = 0; p < width * height; p++) {
+        BandRegion* r = &reference.items[labels[p]];
+        int x = p % width, y = p / width;
+        r->size++;
+        r->sum_r += base.pixels[p].r; r->sum_g += base.pixels[p].g; r->sum_b += base.pixels[p].b;
+        if (x < r->bounds.min_x) r->bounds.min_x = x;
+        if (y < r->bounds.min_y) r->bounds.min_y = y;
+        if (x > r->bounds.max_x) r->bounds.max_x = x;
+        if (y > r->bounds.max_y) r->bounds.max_y = y;
+    }
+    qsort(reference.items, reference.count, sizeof(BandRegion), compare_band_region);
+    ds_free(&ds);
+
+    // One band covering the image gives the same regions as the full segmentation.
+    RowReader reader;
+    BandRegionList single = { 0 };
+    row_reader_from_image(&reader, &base);
+    graph_based_segmentation_bands(&reader, k, sigma, height, 0, collect_band_region, &single, NULL);
+    qsort(single.items, single.count, sizeof(BandRegion), compare_band_region);
+    int single_ok = (single.count == reference.count);
+    for (int i = 0; single_ok && i < single.count; i++) {
+        if (!same_band_region(&single.items[i], &reference.items[i])) single_ok = 0;
+    }
+
+    // Narrow bands, from memory and streamed from a BMP file.
+    BandRegionList banded = { 0 }, streamed = { 0 };
+    clock_t start = clock();
+    row_reader_from_image(&reader, &base);
+    graph_based_segmentation_bands(&reader, k, sigma, band_height, lookahead, collect_band_region, &banded, NULL);
+    double banded_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    // Narrow bands drift from the reference; the lookahead rows must keep that bounded.
+    // Without them the drift is only reported.
+    int* banded_labels = malloc(sizeof(int) * width * height);
+    row_reader_from_image(&reader, &base);
+    graph_based_segmentation_bands(&reader, k, sigma, band_height, lookahead, NULL, NULL, banded_labels);
+    int drift = gbs_label_array_drift(labels, banded_labels, width * height);
+    double drift_ratio = (double)drift / ((double)width * height);
+    if (drift < 0 || drift_ratio > max_drift_ratio) ok = 0;
+
+    row_reader_from_image(&reader, &base);
+    graph_based_segmentation_bands(&reader, k, sigma, band_height, 0, NULL, NULL, banded_labels);
+    int plain_drift = gbs_label_array_drift(labels, banded_labels, width * height);
+
+    save_bmp(bmp_file, base.pixels, width, height);
+    int stream_ok = row_reader_open_bmp(&reader, bmp_file);
+    if (stream_ok) {
+        graph_based_segmentation_bands(&reader, k, sigma, band_height, lookahead, collect_band_region, &streamed, NULL);
+        row_reader_close(&reader);
+    }
+    remove(bmp_file);
+
+    long long covered = 0;
+    for (int i = 0; i < banded.count; i++) {
+        covered += banded.items[i].size;
+        if (banded.items[i].label != i) ok = 0;
+    }
+    if (covered != (long long)width * height) ok = 0;
+    if (streamed.count != banded.count) stream_ok = 0;
+    for (int i = 0; stream_ok && i < banded.count; i++) {
+        if (!same_band_region(&banded.items[i], &streamed.items[i])) stream_ok = 0;
+    }
+    ok = ok && single_ok && stream_ok;
+
+    // Scratch that scales with the rows held at once: source ring, blurred band, labels,
+    // sorted edges with their sort buffer, and the band's disjoint set.
+    double per_row = width * (2 * sizeof(Pixel) + sizeof(int) + sizeof(DSNode) + 4 * 2 * (sizeof(uint32_t) + sizeof(uint16_t)));
+    printf("Image: %s (%d x %d), k %.1f\n", file, width, height, k);
+    printf("Full image:      %d regions, ~%.0f KB of row-sized scratch\n", reference.count, per_row * height / 1024.0);
+    printf("Bands of %3d:    %d regions with %d lookahead rows, ~%.0f KB (%.2f ms)\n", band_height, banded.count, lookahead,
+        per_row * (band_height + lookahead + 5) / 1024.0, banded_ms);
+    printf("Drift from the full image: %d pixels (%.1f%%, limit %.0f%%), %d (%.1f%%) without lookahead\n",
+        drift, 100.0 * drift_ratio, 100.0 * max_drift_ratio, plain_drift, 100.0 * plain_drift / ((double)width * height));
+    printf("Single band matches: %s, BMP stream matches: %s\n", single_ok ? "yes" : "no", stream_ok ? "yes" : "no");
+
+    free(labels);
+    free(banded_labels);
+    free(reference.items);
+    free(single.items);
+    free(banded.items);
+    free(streamed.items);
+    free_image(&base);
+
+    printf("\n");
+    if (!ok) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+// Serial texture histograms (hists[region * 24 + channel * 8 + bin]), one row of gradients at a time.
+static void serial_texture_histograms(const Image* img, const int* pixel_to_region, float* hists) {
+    int width = img->width;
+    int height = img->height;
+    int n = 3 * width;
+    float* mag = malloc(sizeof(float) * n);
+    unsigned char* bin = malloc(n);
+
+    const unsigned char* pixels = (const unsigned char*)img->pixels;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = pixels + (size_t)y * n;
+        const unsigned char* above = (y > 0) ? row - n : row;
+        const unsigned char* below = (y < height - 1) ? row + n : row;
+        texture_gradient_row(above, row, below, width, mag, bin);
+
+        const int* labels = pixel_to_region + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            float* hist = hists + (size_t)labels[x] * 24;
+            hist[bin[3 * x]] += mag[3 * x];
+            hist[8 + bin[3 * x + 1]] += mag[3 * x + 1];
+            hist[16 + bin[3 * x + 2]] += mag[3 * x + 2];
+        }
+    }
+
+    free(mag);
+    free(bin);
+}
+
+int region_stats_test() {
+
+    printf("==========================================\n");
+    printf("============= Region Stats ===============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    int width = base.width, height = base.height;
+    DisjointSet ds;
+    graph_based_segmentation(&ds, &base, 100.0f, 0.5f, 0);
+    RegionList rl = create_regions(&base, &ds);
+    int count = rl.count;
+
+    // Serial reference: the pixel loop create_regions used before the band builder.
+    int* size = calloc(count, sizeof(int));
+    RegionBounds* bounds = malloc(sizeof(RegionBounds) * count);
+    int* colors = calloc((size_t)count * COLOR_HIST_STRIDE, sizeof(int));
+    float* texture = calloc((size_t)count * TEXTURE_HIST_STRIDE, sizeof(float));
+    for (int i = 0; i < count; i++) {
+        bounds[i].min_x = width; bounds[i].max_x = 0;
+        bounds[i].min_y = height; bounds[i].max_y = 0;
+    }
+
+    double start = omp_get_wtime();
+    for (int i = 0; i < width * height; i++) {
+        int idx = rl.pixel_to_region[i];
+        int x = i % width, y = i / width;
+        if (x < bounds[idx].min_x) bounds[idx].min_x = x;
+        if (x > bounds[idx].max_x) bounds[idx].max_x = x;
+        if (y < bounds[idx].min_y) bounds[idx].min_y = y;
+        if (y > bounds[idx].max_y) bounds[idx].max_y = y;
+        size[idx]++;
+        int* hist = &colors[(size_t)idx * COLOR_HIST_STRIDE];
+        hist[base.pixels[i].r * 25 / 256]++;
+        hist[25 + base.pixels[i].g * 25 / 256]++;
+        hist[50 + base.pixels[i].b * 25 / 256]++;
+    }
+    serial_texture_histograms(&base, rl.pixel_to_region, texture);
+    double serial_s = omp_get_wtime() - start;
+
+    int count_mismatch = 0;
+    float texture_diff = 0.0f;
+    for (int i = 0; i < count; i++) {
+        if (rl.size[i] != size[i] || memcmp(&rl.bounds[i], &bounds[i], sizeof(RegionBounds)) != 0) count_mismatch++;
+        if (memcmp(&rl.color_counts[(size_t)i * COLOR_HIST_STRIDE], &colors[(size_t)i * COLOR_HIST_STRIDE], sizeof(int) * 75) != 0) count_mismatch++;
+        for (int j = 0; j < TEXTURE_HIST_STRIDE; j++) {
+            float a = rl.texture_raw[(size_t)i * TEXTURE_HIST_STRIDE + j];
+            float b = texture[(size_t)i * TEXTURE_HIST_STRIDE + j];
+            float d = fabsf(a - b) / (fabsf(b) > 1.0f ? fabsf(b) : 1.0f);
+            if (d > texture_diff) texture_diff = d;
+        }
+    }
+
+    // The texture sums must not depend on how many threads built them.
+    size_t texture_bytes = sizeof(float) * TEXTURE_HIST_STRIDE * count;
+    float* first = malloc(texture_bytes);
+    memcpy(first, rl.texture_raw, texture_bytes);
+    int threads = omp_get_max_threads();
+    int thread_mismatch = 0;
+    double parallel_s = 0.0;
+    for (int t = 1; t <= 4; t++) {
+        omp_set_num_threads(t);
+        start = omp_get_wtime();
+        build_region_stats(&rl, &base, NULL);
+        if (t == threads || (t == 4 && threads > 4)) parallel_s = omp_get_wtime() - start;
+        if (memcmp(first, rl.texture_raw, texture_bytes) != 0) thread_mismatch++;
+    }
+    omp_set_num_threads(threads);
+
+    printf("Image: %s (%d x %d), %d regions, %d threads\n", file, width, height, count, threads);
+    printf("Serial scan:  %.2f ms\n", 1000.0 * serial_s);
+    printf("Band builder: %.2f ms\n", 1000.0 * parallel_s);
+    printf("Integer mismatches: %d, largest texture difference: %.2e, thread-count mismatches: %d\n",
+        count_mismatch, texture_diff, thread_mismatch);
+
+    free(size);
+    free(bounds);
+    free(colors);
+    free(texture);
+    free(first);
+    rl_free(&rl);
+    ds_free(&ds);
+    free_image(&base);
+
+    printf("\n");
+    if (count_mismatch != 0 || thread_mismatch != 0 || texture_diff > 1e-5f) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+int proposal_budget_test() {
+
+    printf("==========================================\n");
+    printf("============ Proposal Budget =============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    ProposalBudget unlimited = unlimited_proposal_budget();
+    ProposalBudget geometry = default_proposal_budget();
+    ProposalBudget capped = default_proposal_budget();
+    capped.max_proposals = 50;
+    const ProposalBudget* budgets[3] = { &unlimited, &geometry, &capped };
+
+    BoundingBoxList lists[3];
+    double times[3];
+    for (int b = 0; b < 3; b++) {
+        DisjointSet ds;
+        graph_based_segmentation(&ds, &base, 100.0f, 0.5f, 0);
+        RegionList rl = create_regions(&base, &ds);
+        init_bbox_list(&lists[b]);
+
+        double start = omp_get_wtime();
+        selective_search_merge_budget(&rl, &ds, &lists[b], 10000, 1.0f, budgets[b]);
+        times[b] = omp_get_wtime() - start;
+
+        rl_free(&rl);
+        ds_free(&ds);
+    }
+
+    // The unlimited run goes down to one region, so its last box is the root of the hierarchy (level 1).
+    int raw_count = lists[0].count;
+    float root_score = (raw_count > 0) ? lists[0].boxes[raw_count - 1].score : 0.0f;
+    int root_ok = root_score >= 1.0f;
+    filter_proposals_by_geometry(&lists[0], base.width, base.height);
+
+    // The geometry budget must emit exactly what the filter keeps, in the same order,
+    // and the capped budget must be the max_proposals best of them by score. Levels are
+    // counted from the root, so the scores match too even though the geometry budget stops
+    // merging early.
+    int geometry_match = lists[1].count == lists[0].count &&
+        memcmp(lists[1].boxes, lists[0].boxes, sizeof(BoundingBox) * lists[0].count) == 0;
+
+    BoundingBoxList top;
+    init_bbox_list(&top);
+    for (int i = 0; i < lists[0].count; i++) add_bbox(&top, lists[0].boxes[i]);
+    keep_top_proposals(&top, capped.max_proposals);
+    int capped_match = lists[2].count == top.count &&
+        memcmp(lists[2].boxes, top.boxes, sizeof(BoundingBox) * top.count) == 0;
+    free_bbox_list(&top);
+
+    printf("Image: %s (%d x %d)\n", file, base.width, base.height);
+    printf("Unlimited: %d boxes, %d after the geometry filter, %.2f ms\n", raw_count, lists[0].count, 1000.0 * times[0]);
+    printf("Geometry budget: %d boxes, %.2f ms (%s)\n", lists[1].count, 1000.0 * times[1], geometry_match ? "match" : "MISMATCH");
+    printf("Budget of %d: %d boxes, %.2f ms (%s)\n", capped.max_proposals, lists[2].count, 1000.0 * times[2], capped_match ? "match" : "MISMATCH");
+    printf("Root merge score: %.3f\n", root_score);
+
+    for (int b = 0; b < 3; b++) free_bbox_list(&lists[b]);
+    free_image(&base);
+
+    printf("\n");
+    if (!geometry_match || !capped_match || !root_ok) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+// The NMS loop as it was before scores: every pair, insertion order as priority.
+static void pairwise_nms(BoundingBoxList* bbl, float iou_threshold) {
+    bool* is_suppressed = calloc(bbl->count > 0 ? bbl->count : 1, sizeof(bool));
+    for (int i = 0; i < bbl->count; i++) {
+        if (is_suppressed[i]) continue;
+        for (int j = i + 1; j < bbl->count; j++) {
+            if (!is_suppressed[j] && calculate_iou(bbl->boxes[i], bbl->boxes[j]) > iou_threshold) is_suppressed[j] = true;
+        }
+    }
+    int kept = 0;
+    for (int i = 0; i < bbl->count; i++) {
+        if (!is_suppressed[i]) bbl->boxes[kept++] = bbl->boxes[i];
+    }
+    bbl->count = kept;
+    free(is_suppressed);
+}
+
+static BoundingBoxList copy_bbox_list(const BoundingBoxList* src) {
+    BoundingBoxList dst;
+    init_bbox_list(&dst);
+    for (int i = 0; i < src->count; i++) add_bbox(&dst, src->boxes[i]);
+    return dst;
+}
+
+int scored_nms_test() {
+
+    printf("==========================================\n");
+    printf("=========== Scored Proposals =============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    SelectiveSearchStrategy strategies[] = {
+        { COLOR_SPACE_RGB, 100.0f, 0.5f, default_similarity_weights(), GBS_MIN_REGION_SIZE, default_proposal_budget() },
+        { COLOR_SPACE_LAB_L_CHANNEL, 100.0f, 0.5f, default_similarity_weights(), GBS_MIN_REGION_SIZE, default_proposal_budget() },
+    };
+    BoundingBoxList raw = run_selective_search_strategies(&base, strategies, 2, 2.0f);
+
+    int bad_scores = 0;
+    for (int i = 0; i < raw.count; i++) {
+        if (!(raw.boxes[i].score > 0.0f) || !isfinite(raw.boxes[i].score)) bad_scores++;
+    }
+
+    // Reference: sort, then the old pairwise loop, which treats list order as priority.
+    BoundingBoxList reference = copy_bbox_list(&raw);
+    sort_bboxes_by_score(&reference);
+    int unsorted = 0;
+    for (int i = 1; i < reference.count; i++) {
+        if (reference.boxes[i].score > reference.boxes[i - 1].score) unsorted++;
+    }
+    BoundingBoxList sorted = copy_bbox_list(&reference);
+
+    double start = omp_get_wtime();
+    pairwise_nms(&reference, 0.5f);
+    double pairwise_s = omp_get_wtime() - start;
+
+    BoundingBoxList nms = copy_bbox_list(&raw);
+    start = omp_get_wtime();
+    non_maximum_suppression(&nms, 0.5f);
+    double scored_s = omp_get_wtime() - start;
+
+    int nms_match = nms.count == reference.count &&
+        memcmp(nms.boxes, reference.boxes, sizeof(BoundingBox) * nms.count) == 0;
+
+    // A top-N selection has to be the head of the full sort.
+    int top_n = 100;
+    BoundingBoxList top = copy_bbox_list(&raw);
+    keep_top_proposals(&top, top_n);
+    int expected_top = (raw.count < top_n) ? raw.count : top_n;
+    int top_match = top.count == expected_top &&
+        memcmp(top.boxes, sorted.boxes, sizeof(BoundingBox) * expected_top) == 0;
+
+    printf("Image: %s (%d x %d), %d raw proposals\n", file, base.width, base.height, raw.count);
+    printf("Best score: %.3f, invalid scores: %d, out of order after sort: %d\n",
+        sorted.count > 0 ? sorted.boxes[0].score : 0.0f, bad_scores, unsorted);
+    printf("Pairwise NMS: %.2f ms, %d kept\n", 1000.0 * pairwise_s, reference.count);
+    printf("Scored NMS:   %.2f ms (including the sort), %d kept (%s)\n", 1000.0 * scored_s, nms.count, nms_match ? "match" : "MISMATCH");
+    printf("Top %d: %s\n", top_n, top_match ? "match" : "MISMATCH");
+
+    free_bbox_list(&raw);
+    free_bbox_list(&reference);
+    free_bbox_list(&sorted);
+    free_bbox_list(&nms);
+    free_bbox_list(&top);
+    free_image(&base);
+
+    printf("\n");
+    if (bad_scores != 0 || unsorted != 0 || !nms_match || !top_match) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
+
+int final_proposals_test() {
+
+    printf("==========================================\n");
+    printf("============ Final Proposals =============\n");
+    printf("\n");
+
+    const char* file = "test2.jpg";
+    const float iou_threshold = 0.5f;
+    Image base;
+
+    if (!load_image(&base, file)) {
+        printf("\n");
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+
+    // The same strategies and post-processing as main.
+    SelectiveSearchStrategy strategies[] = {
+        { COLOR_SPACE_RGB, 500.0f, 2.0f, default_similarity_weights(), GBS_MIN_REGION_SIZE, default_proposal_budget() },
+        { COLOR_SPACE_LAB_L_CHANNEL, 500.0f, 2.0f, default_similarity_weights(), GBS_MIN_REGION_SIZE, default_proposal_budget() },
+    };
+    BoundingBoxList proposals = run_selective_search_strategies_scaled(&base, strategies, 2, 2.0f, 1024, 0);
+    int raw_count = proposals.count;
+    select_final_proposals(&proposals, base.width, base.height, iou_threshold, FINAL_PROPOSAL_COUNT);
+
+    // A full set, best first, without overlapping pairs, and every box admissible.
+    ProposalBudget geometry = default_proposal_budget();
+    long img_area = (long)base.width * base.height;
+    int count_ok = proposals.count == FINAL_PROPOSAL_COUNT;
+    int unsorted = 0, overlapping = 0, rejected = 0;
+    for (int i = 0; i < proposals.count; i++) {
+        if (i > 0 && proposals.boxes[i].score > proposals.boxes[i - 1].score) unsorted++;
+        if (!box_passes_geometry(proposals.boxes[i], img_area, &geometry)) rejected++;
+        for (int j = 0; j < i; j++) {
+            if (calculate_iou(proposals.boxes[j], proposals.boxes[i]) > iou_threshold) overlapping++;
+        }
+    }
+
+    printf("\nImage: %s (%d x %d), %d raw proposals\n", file, base.width, base.height, raw_count);
+    printf("Final: %d proposals (expected %d), scores %.3f .. %.3f\n", proposals.count, FINAL_PROPOSAL_COUNT,
+        proposals.count > 0 ? proposals.boxes[0].score : 0.0f,
+        proposals.count > 0 ? proposals.boxes[proposals.count - 1].score : 0.0f);
+    printf("Out of order: %d, overlapping pairs: %d, rejected by geometry: %d\n", unsorted, overlapping, rejected);
+
+    free_bbox_list(&proposals);
+    free_image(&base);
+
+    printf("\n");
+    if (!count_ok || unsorted != 0 || overlapping != 0 || rejected != 0) {
+        printf("=============== Test Failed ==============\n");
+        printf("==========================================\n");
+        return 0;
+    }
+    printf("=============== Test Passed ==============\n");
+    printf("==========================================\n");
+
+    return 1;
+}
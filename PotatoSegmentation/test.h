@@ -5,4 +5,40 @@ int image_load_test();
 
 int pixel_distance_test();
 
+int gaussian_blur_benchmark();
+
+int gbs_tiled_test();
+
+int similarity_heap_test();
+
+int texture_bin_test();
+
+int color_convert_test();
+
+int similarity_kernel_benchmark();
+
+int strategy_set_test();
+
+int image_features_test();
+
+int gbs_k_sweep_test();
+
+int min_region_size_test();
+
+int fused_blur_edges_test();
+
+int edge_weight_kernel_test();
+
+int gbs_buckets_test();
+
+int band_stream_test();
+
+int region_stats_test();
+
+int proposal_budget_test();
+
+int scored_nms_test();
+
+int final_proposals_test();
+
 #endif // !__TEST_H__
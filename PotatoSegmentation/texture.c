@@ -0,0 +1,114 @@
+#include "texture.h"
+#include "simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+static void texture_gradient_scalar(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+	int n, int begin, int end, float* mag, unsigned char* bin) {
+	for (int i = begin; i < end; i++) {
+		// Horizontal neighbours are 3 bytes apart; at the row ends the pixel itself is used.
+		int left = (i >= 3) ? i - 3 : i;
+		int right = (i + 3 < n) ? i + 3 : i;
+
+		int gx = row[right] - row[left];
+		int gy = below[i] - above[i];
+
+		mag[i] = sqrtf((float)(gx * gx + gy * gy));
+		bin[i] = (unsigned char)texture_bin(gx, gy);
+	}
+}
+
+#ifdef SIMD_SSE2
+// Eight lanes of texture_bin on 16-bit gradients.
+static inline __m128i texture_bin_sse2(__m128i gx, __m128i gy) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i all = _mm_set1_epi16(-1);
+
+	__m128i p = _mm_cmpgt_epi16(gx, zero);                                  // gx > 0
+	__m128i u = _mm_xor_si128(_mm_cmpgt_epi16(zero, gy), all);               // gy >= 0
+	__m128i t1 = _mm_cmpgt_epi16(gy, gx);                                   // gy > gx
+	__m128i t2 = _mm_cmpgt_epi16(_mm_sub_epi16(zero, gx), gy);               // gy < -gx
+
+	// Upper right uses t1, upper left t2, and the lower half the negation of the opposite quadrant.
+	__m128i diff = _mm_xor_si128(p, u);
+	__m128i s = _mm_or_si128(_mm_andnot_si128(diff, t1), _mm_and_si128(diff, t2));
+	__m128i bit = _mm_andnot_si128(u, all);
+	bit = _mm_and_si128(_mm_xor_si128(s, bit), _mm_set1_epi16(1));
+
+	__m128i base = _mm_or_si128(_mm_and_si128(u, _mm_set1_epi16(4)), _mm_and_si128(diff, _mm_set1_epi16(2)));
+	__m128i result = _mm_add_epi16(base, bit);
+
+	// gy == 0 with gx <= 0: atan2 gives pi (bin 0) for gx < 0 and 0 (bin 4) for gx == 0.
+	__m128i on_axis = _mm_andnot_si128(p, _mm_cmpeq_epi16(gy, zero));
+	__m128i axis_bin = _mm_and_si128(_mm_cmpeq_epi16(gx, zero), _mm_set1_epi16(4));
+	return _mm_or_si128(_mm_andnot_si128(on_axis, result), _mm_and_si128(on_axis, axis_bin));
+}
+
+static inline __m128i load_u8x8(const unsigned char* p) {
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+}
+#endif
+
+void texture_gradient_row(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+	int width, float* mag, unsigned char* bin) {
+	int n = 3 * width;
+	int i = 0;
+
+	// The first and last pixel clamp their horizontal neighbour.
+	int head = n < 3 ? n : 3;
+	texture_gradient_scalar(above, row, below, n, 0, head, mag, bin);
+	i = head;
+
+#ifdef SIMD_SSE2
+	for (; i + 8 <= n - 3; i += 8) {
+		__m128i gx = _mm_sub_epi16(load_u8x8(row + i + 3), load_u8x8(row + i - 3));
+		__m128i gy = _mm_sub_epi16(load_u8x8(below + i), load_u8x8(above + i));
+
+		// gx * gx + gy * gy as 32-bit pairs, exact, so sqrt rounds the same as sqrtf.
+		__m128i sq_lo = _mm_madd_epi16(_mm_unpacklo_epi16(gx, gy), _mm_unpacklo_epi16(gx, gy));
+		__m128i sq_hi = _mm_madd_epi16(_mm_unpackhi_epi16(gx, gy), _mm_unpackhi_epi16(gx, gy));
+		_mm_storeu_ps(mag + i, _mm_sqrt_ps(_mm_cvtepi32_ps(sq_lo)));
+		_mm_storeu_ps(mag + i + 4, _mm_sqrt_ps(_mm_cvtepi32_ps(sq_hi)));
+
+		__m128i bins = texture_bin_sse2(gx, gy);
+		_mm_storel_epi64((__m128i*)(bin + i), _mm_packus_epi16(bins, bins));
+	}
+#endif
+
+	texture_gradient_scalar(above, row, below, n, i, n, mag, bin);
+}
+
+void compute_texture_gradients(const Image* img, TextureGradients* grads) {
+	int width = img->width;
+	int height = img->height;
+	int n = 3 * width;
+
+	grads->width = width;
+	grads->height = height;
+	grads->mag = (float*)simd_malloc(sizeof(float) * n * height);
+	grads->bin = (unsigned char*)simd_malloc((size_t)n * height);
+	if (grads->mag == NULL || grads->bin == NULL) {
+		fprintf(stderr, "simd_malloc failed in compute_texture_gradients\n");
+		exit(EXIT_FAILURE);
+	}
+
+	const unsigned char* pixels = (const unsigned char*)img->pixels;
+
+#pragma omp parallel for schedule(static)
+	for (int y = 0; y < height; y++) {
+		const unsigned char* row = pixels + (size_t)y * n;
+		const unsigned char* above = (y > 0) ? row - n : row;
+		const unsigned char* below = (y < height - 1) ? row + n : row;
+
+		texture_gradient_row(above, row, below, width, grads->mag + (size_t)y * n, grads->bin + (size_t)y * n);
+	}
+}
+
+void free_texture_gradients(TextureGradients* grads) {
+	simd_free(grads->mag);
+	simd_free(grads->bin);
+	grads->mag = NULL;
+	grads->bin = NULL;
+}
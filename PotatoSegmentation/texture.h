@@ -0,0 +1,41 @@
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+
+#include "image.h"
+
+#define TEXTURE_ORIENTATIONS 8
+
+/*
+Orientation bin of the gradient (gx, gy), found with sign and slope comparisons.
+Gives the same bin as (int)((atan2f(gy, gx) + M_PI) / (2 * M_PI) * 8) % 8,
+including how that formula rounds on the axes and diagonals.
+*/
+static inline int texture_bin(int gx, int gy) {
+	if (gy >= 0) {
+		if (gx > 0) return gy <= gx ? 4 : 5;
+		if (gx == 0) return gy == 0 ? 4 : 6;
+		if (gy == 0) return 0;
+		return gy >= -gx ? 6 : 7;
+	}
+	if (gx <= 0) return gy <= gx ? 1 : 0;
+	return -gy <= gx ? 3 : 2;
+}
+
+// Gradient magnitude and orientation bin for one row of interleaved RGB, all channels at once.
+// above and below are the neighbouring rows, clamped at the image border.
+// mag and bin receive 3 * width values in the same r g b order as the pixels.
+void texture_gradient_row(const unsigned char* above, const unsigned char* row, const unsigned char* below,
+	int width, float* mag, unsigned char* bin);
+
+// Magnitude and orientation bin of every pixel and channel, kept for reuse across region sets.
+typedef struct {
+	int width, height;
+	float* mag;            // 3 * width * height, r g b interleaved like the pixels
+	unsigned char* bin;
+} TextureGradients;
+
+void compute_texture_gradients(const Image* img, TextureGradients* grads);
+
+void free_texture_gradients(TextureGradients* grads);
+
+#endif // !__TEXTURE_H__
@@ -34,7 +34,7 @@ void visualize_bounding_boxes(Image* img, BoundingBoxList* bbl, const char* file
         draw_rectangle(vis_img.pixels, vis_img.width, vis_img.height, bbl->boxes[i], color);
     }
     save_bmp(filename, vis_img.pixels, vis_img.width, vis_img.height);
-    free(vis_img.pixels);
+    free_image(&vis_img);
 }
 
 void save_bmp(const char* filename, Pixel* data, int width, int height) {
@@ -76,8 +76,6 @@ void save_bmp(const char* filename, Pixel* data, int width, int height) {
     fclose(f);
 }
 
-#define MAX_LABELS 1000000
-
 void visualize_labels(DisjointSet* ds, const char* filename, int width, int height) {
     int pixel_count = width * height;
     int* labels = malloc(sizeof(int) * pixel_count);
@@ -86,9 +84,7 @@ void visualize_labels(DisjointSet* ds, const char* filename, int width, int heig
         return;
     }
 
-    for (int i = 0; i < pixel_count; i++) {
-        labels[i] = ds_find(ds, i);
-    }
+    int label_count = ds_flatten(ds, labels);
 
     Pixel* output = malloc(sizeof(Pixel) * pixel_count);
     if (!output) {
@@ -97,40 +93,26 @@ void visualize_labels(DisjointSet* ds, const char* filename, int width, int heig
         return;
     }
 
-    Pixel* label_colors = malloc(sizeof(Pixel) * MAX_LABELS);
+    Pixel* label_colors = malloc(sizeof(Pixel) * (label_count > 0 ? label_count : 1));
     if (!label_colors) {
         fprintf(stderr, "malloc failed for label_colors\n");
         free(labels);
         free(output);
         return;
     }
-
-    bool* label_assigned = calloc(MAX_LABELS, sizeof(bool));
-    if (!label_assigned) {
-        fprintf(stderr, "calloc failed for label_assigned\n");
-        free(labels);
-        free(output);
-        free(label_colors);
-        return;
-    }
     
     ////////////////////////////////////////////////////////////////
 
     srand((unsigned int)time(NULL));
 
+    for (int i = 0; i < label_count; i++) {
+        label_colors[i].r = rand() % 256;
+        label_colors[i].g = rand() % 256;
+        label_colors[i].b = rand() % 256;
+    }
+
     for (int i = 0; i < pixel_count; i++) {
-        int label = labels[i];
-        if (label < 0 || label >= MAX_LABELS) {
-            fprintf(stderr, "Warning: invalid label %d at pixel %d\n", label, i);
-            label = 0;
-        }
-        if (!label_assigned[label]) {
-            label_colors[label].r = rand() % 256;
-            label_colors[label].g = rand() % 256;
-            label_colors[label].b = rand() % 256;
-            label_assigned[label] = true;
-        }
-        output[i] = label_colors[label];
+        output[i] = label_colors[labels[i]];
     }
 
     save_bmp(filename, output, width, height);
@@ -138,7 +120,6 @@ void visualize_labels(DisjointSet* ds, const char* filename, int width, int heig
     free(labels);
     free(output);
     free(label_colors);
-    free(label_assigned);
 }
 
 void visualize_regions(RegionList* rl, int width, int height, const char* filename) {
@@ -168,7 +149,7 @@ void visualize_regions(RegionList* rl, int width, int height, const char* filena
     }
 
     for (int i = 0; i < rl->count; i++) {
-        Region* r = &rl->regions[i];
+        RegionBounds* r = &rl->bounds[i];
         for (int y = r->min_y; y <= r->max_y; y++) {
             for (int x = r->min_x; x <= r->max_x; x++) {
                 int idx = y * width + x;